@@ -0,0 +1,78 @@
+#ifndef ED_PERCEPTION_BATCH_MODULE_H_
+#define ED_PERCEPTION_BATCH_MODULE_H_
+
+#include <ed/perception/module.h>
+#include <ed/entity.h>
+
+#include "parallel_for.h"
+
+#include <vector>
+
+namespace ed
+{
+namespace perception
+{
+
+// ----------------------------------------------------------------------------------------------------
+
+// Perception module that can classify several entities in one call. The default implementation simply
+// calls classify for each entity. Modules override classifyBatch to amortize per-call setup over the
+// batch and / or to process the entities in parallel.
+class BatchModule : public Module
+{
+
+public:
+
+    BatchModule(const std::string& name) : Module(name) {}
+
+    virtual ~BatchModule() {}
+
+    // Classifies entities[i] given priors[i] and writes the result to outputs[i]. 'outputs' is
+    // resized to the number of entities.
+    virtual void classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                               const std::vector<CategoricalDistribution>& priors,
+                               std::vector<ClassificationOutput>& outputs) const
+    {
+        outputs.resize(entities.size());
+        for(unsigned int i = 0; i < entities.size(); ++i)
+            classify(*entities[i], property, priors[i], outputs[i]);
+    }
+
+protected:
+
+    // Same as the default classifyBatch, but runs classify for the entities in parallel (see parallelFor). Can
+    // be used by modules of which classify is thread-safe.
+    void classifyBatchParallel(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                               const std::vector<CategoricalDistribution>& priors,
+                               std::vector<ClassificationOutput>& outputs, unsigned int max_threads = 0) const
+    {
+        outputs.resize(entities.size());
+        parallelFor(entities.size(), ClassifyTask(*this, entities, property, priors, outputs), max_threads);
+    }
+
+private:
+
+    struct ClassifyTask
+    {
+        ClassifyTask(const BatchModule& module_, const std::vector<ed::EntityConstPtr>& entities_, const std::string& property_,
+                     const std::vector<CategoricalDistribution>& priors_, std::vector<ClassificationOutput>& outputs_)
+            : module(module_), entities(entities_), property(property_), priors(priors_), outputs(outputs_) {}
+
+        void operator()(unsigned int i) const
+        {
+            module.classify(*entities[i], property, priors[i], outputs[i]);
+        }
+
+        const BatchModule& module;
+        const std::vector<ed::EntityConstPtr>& entities;
+        const std::string& property;
+        const std::vector<CategoricalDistribution>& priors;
+        std::vector<ClassificationOutput>& outputs;
+    };
+
+};
+
+}
+}
+
+#endif
@@ -0,0 +1,111 @@
+#include "cascade_registry.h"
+
+#include <opencv2/core/version.hpp>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <map>
+
+namespace ed
+{
+namespace perception
+{
+
+namespace
+{
+
+typedef std::map<std::string, boost::shared_ptr<cv::CascadeClassifier> > CascadeMap;
+
+// Parsed cascade files, read once per process. A storage that is not opened means the file could not be read.
+// The storages are only accessed with the mutex locked.
+boost::mutex files_mutex;
+std::map<std::string, cv::FileStorage> files;
+
+// Cascade instances of the calling thread
+boost::thread_specific_ptr<CascadeMap> thread_cascades;
+
+// ----------------------------------------------------------------------------------------------------
+
+// Gives access to the old style (haartraining) cascade, which CascadeClassifier::read does not support
+class OldStyleCascadeReader : public cv::CascadeClassifier
+{
+
+public:
+
+    bool readOldStyle(const cv::FileNode& node)
+    {
+#if CV_MAJOR_VERSION < 3
+        oldCascade = cv::Ptr<CvHaarClassifierCascade>(static_cast<CvHaarClassifierCascade*>(node.readObj()));
+        return !oldCascade.empty();
+#else
+        return false;
+#endif
+    }
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+const cv::FileStorage& parseFile(const std::string& path)
+{
+    std::map<std::string, cv::FileStorage>::iterator it = files.find(path);
+    if (it != files.end())
+        return it->second;
+
+    cv::FileStorage& fs = files[path];
+    try
+    {
+        fs.open(path, cv::FileStorage::READ);
+    }
+    catch (const cv::Exception&)
+    {
+        fs.release();
+    }
+
+    return fs;
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+cv::CascadeClassifier* CascadeRegistry::get(const std::string& path)
+{
+    if (!thread_cascades.get())
+        thread_cascades.reset(new CascadeMap);
+
+    CascadeMap& cascades = *thread_cascades;
+
+    CascadeMap::iterator it = cascades.find(path);
+    if (it != cascades.end())
+        return it->second.get();
+
+    boost::shared_ptr<OldStyleCascadeReader> cascade(new OldStyleCascadeReader);
+
+    {
+        boost::lock_guard<boost::mutex> lg(files_mutex);
+
+        const cv::FileStorage& fs = parseFile(path);
+        if (!fs.isOpened())
+        {
+            cascade.reset();
+        }
+        else if (!cascade->read(fs.getFirstTopLevelNode()) && !cascade->readOldStyle(fs.getFirstTopLevelNode()))
+        {
+            // Old style cascades can not be created from a parsed node with OpenCV 3, so these are loaded
+            // from disk (once per thread)
+            if (!cascade->load(path))
+                cascade.reset();
+        }
+    }
+
+    // Also remember failures, such that the file is not tried again
+    cascades[path] = cascade;
+
+    return cascade.get();
+}
+
+}
+}
@@ -0,0 +1,30 @@
+#ifndef ED_PERCEPTION_CASCADE_REGISTRY_H_
+#define ED_PERCEPTION_CASCADE_REGISTRY_H_
+
+#include "opencv2/objdetect/objdetect.hpp"
+
+#include <string>
+
+namespace ed
+{
+namespace perception
+{
+
+// Process-wide registry of Haar cascade classifiers, keyed by the path of the cascade XML file. The file is
+// read and parsed only once. Because a cv::CascadeClassifier can not be used by multiple threads at the
+// same time, every thread gets its own instance, which is created from the parsed file on first use and
+// kept for the lifetime of the thread (the threads of the parallelFor pool live as long as the process).
+class CascadeRegistry
+{
+
+public:
+
+    // Returns the calling thread's instance of the cascade in 'path', or 0 if it can not be loaded
+    static cv::CascadeClassifier* get(const std::string& path);
+
+};
+
+}
+}
+
+#endif
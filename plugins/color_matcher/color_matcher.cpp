@@ -21,9 +21,42 @@
 
 #include <ros/package.h>
 
+#include <boost/thread/tss.hpp>
+
+#include <cstdlib>
+#include <sstream>
+
+// ---------------------------------------------------------------------------------------------------
+
+namespace
+{
+
+// Bin counts used by calculateHistogram, kept per thread so they are only allocated once. All counts are
+// zero between calls: only the bins that were hit are reset afterwards.
+struct HistogramBuffers
+{
+    std::vector<int> bin_counts;
+    std::vector<int> bins_hit;
+};
+
+boost::thread_specific_ptr<HistogramBuffers> thread_histogram_buffers;
+
+HistogramBuffers& getHistogramBuffers()
+{
+    if (!thread_histogram_buffers.get())
+    {
+        thread_histogram_buffers.reset(new HistogramBuffers());
+        thread_histogram_buffers->bin_counts.resize(ColorNameTable::numBins(), 0);
+    }
+
+    return *thread_histogram_buffers;
+}
+
+}
+
 // ---------------------------------------------------------------------------------------------------
 
-ColorMatcher::ColorMatcher() : ed::perception::Module("color_matcher")
+ColorMatcher::ColorMatcher() : ed::perception::BatchModule("color_matcher"), color_margin_(0)
 {
     this->registerPropertyServed("type");
     this->registerPropertyServed("color");
@@ -54,20 +87,26 @@ void ColorMatcher::classify(const ed::Entity& e, const std::string& property,
         return;
     }
 
-    for(std::map<std::string, ColorModel>::const_iterator it = models_.begin(); it != models_.end(); ++it)
-    {
-        const std::string& model_name = it->first;
-        const ColorModel& model = it->second;
+    unsigned int num_models = model_names_.size();
+    std::vector<unsigned char> matches(num_models, 1);
 
-        output.likelihood.setScore(model_name, 1);
+    if (num_models > 0)
+    {
+        unsigned char* match = &matches[0];
         for(unsigned int i = 0; i < ColorNameTable::NUM_COLORS; ++i)
         {
             float v = color_histogram[i];
-            if (v < model.min[i] - color_margin_ || v > model.max[i] + color_margin_)
-                output.likelihood.setScore(model_name, 0);
+            const float* lower = &model_lower_[i][0];
+            const float* upper = &model_upper_[i][0];
+
+            for(unsigned int j = 0; j < num_models; ++j)
+                match[j] &= (lower[j] <= v) & (v <= upper[j]);
         }
     }
 
+    for(unsigned int j = 0; j < num_models; ++j)
+        output.likelihood.setScore(model_names_[j], matches[j]);
+
     // Represent data (for debugging)
     result.writeArray("colors");
     for(unsigned int i = 0; i < ColorNameTable::NUM_COLORS; ++i)
@@ -109,6 +148,8 @@ void ColorMatcher::addTrainingInstance(const ed::Entity& e, const std::string& p
             model.max[i] = std::max(model.max[i], color_histogram[i]);
         }
     }
+
+    updateModelIndex();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -151,6 +192,8 @@ void ColorMatcher::loadRecognitionData(const std::string& path_str)
     }
 
     r.endArray(); // models
+
+    updateModelIndex();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -200,6 +243,13 @@ void ColorMatcher::calculateHistogram(const ed::Entity& e, ColorHistogram& histo
     // get color image
     const cv::Mat& img = msr->image()->getRGBImage();
 
+    // Phase 1: count the pixels per quantized RGB bin. Only integer increments per pixel; the bins
+    // that are hit are remembered such that phase 2 only has to visit those.
+    HistogramBuffers& buffers = getHistogramBuffers();
+    std::vector<int>& bin_counts = buffers.bin_counts;
+    std::vector<int>& bins_hit = buffers.bins_hit;
+    bins_hit.clear();
+
     int pixel_count = 0;
 
     for(ed::ImageMask::const_iterator it = msr->imageMask().begin(img.cols); it != msr->imageMask().end(); ++it)
@@ -207,13 +257,23 @@ void ColorMatcher::calculateHistogram(const ed::Entity& e, ColorHistogram& histo
         ++pixel_count;
         const cv::Point2i p(it());
 
-        // Calculate prob distribution
         const cv::Vec3b& bgr = img.at<cv::Vec3b>(p);
 
-        const float* probs = color_table_.rgbToDistribution(bgr[2], bgr[1], bgr[0]);
+        int bin = color_table_.rgbToBin(bgr[2], bgr[1], bgr[0]);
+        if (bin_counts[bin]++ == 0)
+            bins_hit.push_back(bin);
+    }
+
+    // Phase 2: sparse product of the bin counts with the color name table
+    for(std::vector<int>::const_iterator it = bins_hit.begin(); it != bins_hit.end(); ++it)
+    {
+        const float* probs = color_table_.binToDistribution(*it);
+        float count = bin_counts[*it];
 
         for(unsigned int i = 0; i < ColorNameTable::NUM_COLORS; ++i)
-            histogram[i] += probs[i];
+            histogram[i] += count * probs[i];
+
+        bin_counts[*it] = 0;
     }
 
     // normalize histogram
@@ -227,6 +287,7 @@ void ColorMatcher::configureClassification(tue::Configuration config)
 {
     config.value("color_margin", color_margin_);
     initialize();
+    updateModelIndex();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -238,10 +299,51 @@ void ColorMatcher::configureTraining(tue::Configuration config)
 
 // ----------------------------------------------------------------------------------------------------
 
+void ColorMatcher::updateModelIndex()
+{
+    model_names_.clear();
+    model_lower_.assign(ColorNameTable::NUM_COLORS, std::vector<float>());
+    model_upper_.assign(ColorNameTable::NUM_COLORS, std::vector<float>());
+
+    for(std::map<std::string, ColorModel>::const_iterator it = models_.begin(); it != models_.end(); ++it)
+    {
+        const ColorModel& model = it->second;
+
+        model_names_.push_back(it->first);
+        for(unsigned int i = 0; i < ColorNameTable::NUM_COLORS; ++i)
+        {
+            model_lower_[i].push_back(model.min[i] - color_margin_);
+            model_upper_[i].push_back(model.max[i] + color_margin_);
+        }
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 void ColorMatcher::initialize()
 {
-    std::string color_table_path = ros::package::getPath("ed_perception") + "/data/color_names.txt";
-    color_table_.readFromFile(color_table_path);
+    std::string color_table_path = ros::package::getPath("ed_perception") + "/data/color_names";
+
+    // Prefer the binary table (see convert-color-names), fall back to parsing the text table. The build
+    // generates the binary table in the share directory of the package, which is the package path when
+    // installed, and one of the CMAKE_PREFIX_PATH entries (the devel space) otherwise.
+    if (color_table_.readFromBinaryFile(color_table_path + ".bin"))
+        return;
+
+    const char* prefix_path = getenv("CMAKE_PREFIX_PATH");
+    std::stringstream prefixes(prefix_path ? prefix_path : "");
+    std::string prefix;
+    while (std::getline(prefixes, prefix, ':'))
+    {
+        if (!prefix.empty() && color_table_.readFromBinaryFile(prefix + "/share/ed_perception/data/color_names.bin"))
+            return;
+    }
+
+    std::cout << "[color_matcher] Could not find binary color name table 'share/ed_perception/data/color_names.bin', "
+              << "parsing the text table instead" << std::endl;
+
+    if (!color_table_.readFromFile(color_table_path + ".txt"))
+        std::cout << "[color_matcher] Could not read color name table '" << color_table_path << ".txt'" << std::endl;
 }
 
 // ----------------------------------------------------------------------------------------------------
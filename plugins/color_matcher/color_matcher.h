@@ -15,7 +15,7 @@
 // Color name table
 #include "color_name_table.h"
 
-#include <ed/perception/module.h>
+#include "../batch_module.h"
 
 typedef std::vector<float> ColorHistogram;
 
@@ -25,7 +25,7 @@ struct ColorModel
     ColorHistogram max;
 };
 
-class ColorMatcher : public ed::perception::Module
+class ColorMatcher : public ed::perception::BatchModule
 {
 
 public:
@@ -41,6 +41,14 @@ public:
     void classify(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
                   ed::perception::ClassificationOutput& output) const;
 
+    // classify is thread-safe, so entities are classified in parallel
+    void classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                       const std::vector<ed::perception::CategoricalDistribution>& priors,
+                       std::vector<ed::perception::ClassificationOutput>& outputs) const
+    {
+        classifyBatchParallel(entities, property, priors, outputs);
+    }
+
     void addTrainingInstance(const ed::Entity& e, const std::string& property, const std::string& value);
 
     void loadRecognitionData(const std::string& path);
@@ -53,6 +61,15 @@ private:
 
     std::map<std::string, ColorModel> models_;
 
+    // Flattened copy of models_ used for classification. For each color bin, the lower and upper bounds
+    // (including the color margin) of all models are stored contiguously, such that all models can be
+    // tested against a histogram bin in one (vectorizable) pass.
+    std::vector<std::string> model_names_;
+    std::vector<std::vector<float> > model_lower_;  // [color][model]
+    std::vector<std::vector<float> > model_upper_;  // [color][model]
+
+    void updateModelIndex();
+
     void calculateHistogram(const ed::Entity& e, ColorHistogram& histogram) const;
 
 
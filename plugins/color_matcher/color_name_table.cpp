@@ -1,11 +1,51 @@
 #include "color_name_table.h"
 
 #include <fstream>
+#include <cstring>
+#include <limits>
+#include <algorithm>
+
+#include <stdint.h>
 
 int ColorNameTable::RESOLUTION = 32;
 int ColorNameTable::NUM_COLORS = 11;
 int ColorNameTable::STEP = 256 / RESOLUTION;
 
+namespace
+{
+
+// Header of the binary color name table, followed by RESOLUTION^3 * NUM_COLORS probabilities
+struct BinaryHeader
+{
+    char magic[4];          // "EDCN"
+    uint32_t version;
+    uint32_t resolution;
+    uint32_t num_colors;
+    uint32_t bits;          // 32 (float), 16 or 8 (quantized unsigned integer)
+};
+
+const uint32_t BINARY_VERSION = 1;
+
+template<typename T>
+void dequantize(const T* data, std::vector<float>& table)
+{
+    float scale = 1.0f / std::numeric_limits<T>::max();
+    for(unsigned int i = 0; i < table.size(); ++i)
+        table[i] = scale * data[i];
+}
+
+template<typename T>
+void quantize(const std::vector<float>& table, std::vector<char>& buffer)
+{
+    buffer.resize(table.size() * sizeof(T));
+    T* data = reinterpret_cast<T*>(&buffer[0]);
+    float max = std::numeric_limits<T>::max();
+    for(unsigned int i = 0; i < table.size(); ++i)
+        data[i] = static_cast<T>(std::min(std::max(table[i], 0.0f), 1.0f) * max + 0.5f);
+}
+
+}
+
 
 // ----------------------------------------------------------------------------------------------------
 
@@ -48,6 +88,91 @@ bool ColorNameTable::readFromFile(const std::string& filename)
             }
         }
     }
+
+    // a truncated or malformed table fails one of the reads above
+    if (!file)
+    {
+        table_.clear();
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ColorNameTable::readFromBinaryFile(const std::string& filename)
+{
+    std::ifstream file(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+    if (!file.is_open())
+        return false;
+
+    BinaryHeader header;
+    if (!file.read(reinterpret_cast<char*>(&header), sizeof(header)))
+        return false;
+
+    unsigned int size = RESOLUTION * RESOLUTION * RESOLUTION * NUM_COLORS;
+
+    if (std::strncmp(header.magic, "EDCN", 4) != 0
+            || header.version != BINARY_VERSION
+            || header.resolution != (uint32_t)RESOLUTION
+            || header.num_colors != (uint32_t)NUM_COLORS
+            || (header.bits != 32 && header.bits != 16 && header.bits != 8))
+        return false;
+
+    // float tables are read straight into the table, quantized ones are read into a buffer first
+    std::vector<float> table(size);
+    std::vector<char> buffer;
+    char* data = reinterpret_cast<char*>(&table[0]);
+    if (header.bits != 32)
+    {
+        buffer.resize(size * (header.bits / 8));
+        data = &buffer[0];
+    }
+
+    // the file must hold exactly the table
+    if (!file.read(data, size * (header.bits / 8)) || file.peek() != std::char_traits<char>::eof())
+        return false;
+
+    if (header.bits == 16)
+        dequantize(reinterpret_cast<const uint16_t*>(data), table);
+    else if (header.bits == 8)
+        dequantize(reinterpret_cast<const uint8_t*>(data), table);
+
+    table_.swap(table);
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool ColorNameTable::writeToBinaryFile(const std::string& filename, int bits) const
+{
+    if (table_.empty() || (bits != 32 && bits != 16 && bits != 8))
+        return false;
+
+    BinaryHeader header;
+    std::memcpy(header.magic, "EDCN", 4);
+    header.version = BINARY_VERSION;
+    header.resolution = RESOLUTION;
+    header.num_colors = NUM_COLORS;
+    header.bits = bits;
+
+    std::vector<char> buffer;
+    if (bits == 32)
+        buffer.assign(reinterpret_cast<const char*>(&table_[0]), reinterpret_cast<const char*>(&table_[0] + table_.size()));
+    else if (bits == 16)
+        quantize<uint16_t>(table_, buffer);
+    else
+        quantize<uint8_t>(table_, buffer);
+
+    std::ofstream file(filename.c_str(), std::ios_base::out | std::ios_base::binary);
+    if (!file.is_open())
+        return false;
+
+    file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    file.write(&buffer[0], buffer.size());
+
+    return file.good();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -34,11 +34,32 @@ public:
 
     bool readFromFile(const std::string& filename);
 
+    // Reads a table written by writeToBinaryFile. This is a single read of the file, so loading is
+    // (almost) free compared to parsing the text table with readFromFile.
+    bool readFromBinaryFile(const std::string& filename);
+
+    // Writes the table in binary form. Probabilities are stored as 32-bit floats, or quantized
+    // to 16 or 8 bit unsigned integers if 'bits' is 16 or 8.
+    bool writeToBinaryFile(const std::string& filename, int bits = 32) const;
+
     inline const float* rgbToDistribution(int r, int g, int b) const
     {
-        return &table_[NUM_COLORS * ((r / STEP) + (RESOLUTION * ((g / STEP) + (RESOLUTION * (b / STEP)))))];
+        return binToDistribution(rgbToBin(r, g, b));
+    }
+
+    // Index of the quantized RGB bin the color falls into (in [0, numBins()))
+    inline int rgbToBin(int r, int g, int b) const
+    {
+        return (r / STEP) + (RESOLUTION * ((g / STEP) + (RESOLUTION * (b / STEP))));
     }
 
+    inline const float* binToDistribution(int bin) const
+    {
+        return &table_[NUM_COLORS * bin];
+    }
+
+    static int numBins() { return RESOLUTION * RESOLUTION * RESOLUTION; }
+
     static const char* intToColorName(int i);
 
 private:
@@ -0,0 +1,84 @@
+#include "dnn_face_detector.h"
+
+#include <iostream>
+
+// ----------------------------------------------------------------------------------------------------
+
+DnnFaceDetector::DnnFaceDetector() : loaded_(false), input_size_(300)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+DnnFaceDetector::~DnnFaceDetector()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool DnnFaceDetector::load(const std::string& model_path, const std::string& config_path, int input_size)
+{
+    loaded_ = false;
+    input_size_ = input_size;
+
+#ifdef ED_PERCEPTION_HAVE_DNN
+    try
+    {
+        net_ = cv::dnn::readNet(model_path, config_path);
+        net_.setPreferableBackend(cv::dnn::DNN_BACKEND_OPENCV);
+        net_.setPreferableTarget(cv::dnn::DNN_TARGET_CPU);
+        loaded_ = !net_.empty();
+    }
+    catch(const cv::Exception& e)
+    {
+        std::cout << "[DnnFaceDetector] Could not load network: " << e.what() << std::endl;
+    }
+#else
+    std::cout << "[DnnFaceDetector] OpenCV has no (usable) dnn module, OpenCV >= 3.4.2 is needed" << std::endl;
+#endif
+
+    return loaded_;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void DnnFaceDetector::detect(const std::vector<cv::Mat>& images, float confidence_threshold,
+                             std::vector<std::vector<cv::Rect> >& faces) const
+{
+    faces.assign(images.size(), std::vector<cv::Rect>());
+
+#ifdef ED_PERCEPTION_HAVE_DNN
+    if (!loaded_ || images.empty())
+        return;
+
+    // mean values of the res10 face detector training set
+    cv::Mat blob = cv::dnn::blobFromImages(images, 1.0, cv::Size(input_size_, input_size_), cv::Scalar(104, 177, 123), false, false);
+
+    cv::Mat output;
+    {
+        boost::lock_guard<boost::mutex> lg(net_mutex_);
+        net_.setInput(blob);
+        output = net_.forward();
+    }
+
+    // output is 1 x 1 x N x 7, each row is: image index, class, confidence, x_min, y_min, x_max, y_max
+    cv::Mat detections(output.size[2], output.size[3], CV_32F, output.ptr<float>());
+
+    for(int i = 0; i < detections.rows; ++i)
+    {
+        const float* d = detections.ptr<float>(i);
+
+        int image_index = d[0];
+        if (image_index < 0 || image_index >= (int)images.size() || d[2] < confidence_threshold)
+            continue;
+
+        const cv::Mat& img = images[image_index];
+
+        cv::Rect face(cv::Point(d[3] * img.cols, d[4] * img.rows), cv::Point(d[5] * img.cols, d[6] * img.rows));
+        face &= cv::Rect(0, 0, img.cols, img.rows);
+
+        if (face.area() > 0)
+            faces[image_index].push_back(face);
+    }
+#endif
+}
@@ -0,0 +1,55 @@
+#ifndef ED_PERCEPTION_DNN_FACE_DETECTOR_H_
+#define ED_PERCEPTION_DNN_FACE_DETECTOR_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/core/version.hpp>
+
+#include <boost/thread/mutex.hpp>
+
+#include <string>
+#include <vector>
+
+// The dnn module exists since OpenCV 3.3, but cv::dnn::readNet and DNN_BACKEND_OPENCV, which are used here,
+// are only available since OpenCV 3.4.2 (OpenCV 2.4 defines CV_VERSION_EPOCH)
+#if !defined(CV_VERSION_EPOCH) && (CV_VERSION_MAJOR > 3 || (CV_VERSION_MAJOR == 3 && (CV_VERSION_MINOR > 4 || \
+    (CV_VERSION_MINOR == 4 && CV_VERSION_REVISION >= 2))))
+#define ED_PERCEPTION_HAVE_DNN
+#include <opencv2/dnn.hpp>
+#endif
+
+// CNN (SSD style) face detector running on the CPU through OpenCV's dnn module, e.g. the res10 300x300
+// face detector shipped with OpenCV. All images given to detect are processed in a single inference call.
+class DnnFaceDetector
+{
+
+public:
+
+    DnnFaceDetector();
+
+    ~DnnFaceDetector();
+
+    // Loads the network from a model file and (optional) configuration file, e.g. a Caffe model and
+    // prototxt. 'input_size' is the (square) input size of the network.
+    bool load(const std::string& model_path, const std::string& config_path, int input_size);
+
+    bool isLoaded() const { return loaded_; }
+
+    // Detects faces in all images with one batched inference call. faces[i] are the faces found in
+    // images[i], in the coordinates of that image.
+    void detect(const std::vector<cv::Mat>& images, float confidence_threshold, std::vector<std::vector<cv::Rect> >& faces) const;
+
+private:
+
+    bool loaded_;
+
+    int input_size_;
+
+#ifdef ED_PERCEPTION_HAVE_DNN
+    // A network can only run one inference at a time
+    mutable boost::mutex net_mutex_;
+    mutable cv::dnn::Net net_;
+#endif
+
+};
+
+#endif
@@ -16,10 +16,186 @@
 #include <boost/filesystem.hpp>
 
 #include "shared_methods.h"
+#include "cascade_registry.h"
+#include "dnn_face_detector.h"
+#include "parallel_for.h"
+
+namespace
+{
+
+// Grouping threshold used by OpenCV's CascadeClassifier::detectMultiScale
+const double GROUP_EPS = 0.2;
+
+// Face tracks of entities that were not seen for this long (in seconds) are removed
+const double FACE_TRACK_TIMEOUT = 10;
+
+struct ImagePyramid
+{
+    std::vector<cv::Mat> levels;
+    std::vector<double> scales;     // scale of each level w.r.t. the original image
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Builds a pyramid of which the levels are scaled down by 'scale_factor', until the level is smaller than
+// 'min_window'. Levels at which the window would be smaller than 'min_scale' times its size are skipped.
+// The scale factor must be larger than 1; otherwise only the original image is added.
+void buildPyramid(const cv::Mat& img, double scale_factor, const cv::Size& min_window, double min_scale, ImagePyramid& pyramid)
+{
+    if (scale_factor <= 1)
+    {
+        pyramid.levels.push_back(img);
+        pyramid.scales.push_back(1);
+        return;
+    }
+
+    for(double scale = 1; ; scale *= scale_factor)
+    {
+        if (scale * scale_factor < min_scale)
+            continue;
+
+        cv::Size size(cvRound(img.cols / scale), cvRound(img.rows / scale));
+        if (size.width < min_window.width || size.height < min_window.height)
+            break;
+
+        pyramid.levels.push_back(cv::Mat());
+        if (scale == 1)
+            pyramid.levels.back() = img;
+        else
+            cv::resize(img, pyramid.levels.back(), size, 0, 0, cv::INTER_LINEAR);
+
+        pyramid.scales.push_back(scale);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Runs the cascade at its original window size on pyramid levels of which the (scaled) window lies within
+// [min_size, max_size], and groups the candidates of all levels like detectMultiScale does. The pyramid may be
+// finer than 'scale_factor' (it is shared with another cascade); levels are then skipped such that consecutive
+// evaluated levels are at least 'scale_factor' apart.
+void detectOnPyramid(cv::CascadeClassifier& classifier, const ImagePyramid& pyramid, double scale_factor, int min_neighbours,
+                     const cv::Size& min_size, const cv::Size& max_size, std::vector<cv::Rect>& faces)
+{
+    cv::Size window = classifier.getOriginalWindowSize();
+
+    faces.clear();
+    std::vector<cv::Rect> level_faces;
+
+    double next_scale = 0;
+    for(unsigned int i = 0; i < pyramid.levels.size(); ++i)
+    {
+        const cv::Mat& level = pyramid.levels[i];
+        double scale = pyramid.scales[i];
+
+        // small tolerance for the rounding in the repeated multiplication of the pyramid scales
+        if (scale < next_scale * 0.999)
+            continue;
+
+        cv::Size scaled_window(cvRound(window.width * scale), cvRound(window.height * scale));
+        if (scaled_window.width < min_size.width || scaled_window.height < min_size.height)
+            continue;
+
+        if (max_size.width > 0 && (scaled_window.width > max_size.width || scaled_window.height > max_size.height))
+            break;
+
+        if (level.cols < window.width || level.rows < window.height)
+            break;
+
+        // single scale detection, without grouping
+        classifier.detectMultiScale(level, level_faces, 1.1, 0, CV_HAAR_SCALE_IMAGE, window, window);
+        next_scale = scale * scale_factor;
+
+        for(std::vector<cv::Rect>::const_iterator it = level_faces.begin(); it != level_faces.end(); ++it)
+            faces.push_back(cv::Rect(cvRound(it->x * scale), cvRound(it->y * scale), scaled_window.width, scaled_window.height));
+    }
+
+    cv::groupRectangles(faces, min_neighbours, GROUP_EPS);
+}
 
 // ----------------------------------------------------------------------------------------------------
 
-FaceDetector::FaceDetector() : ed::perception::Module("face_detector")
+// Parameters and result of running one cascade on a pyramid (see detectOnPyramid)
+struct CascadeRun
+{
+    cv::CascadeClassifier* classifier;
+    double scale_factor;
+    int min_neighbours;
+    cv::Size min_size;
+    cv::Size max_size;
+    std::vector<cv::Rect>* faces;
+};
+
+// runs the cascades on the same pyramid, to run them in parallel
+struct DetectOnPyramidTask
+{
+    DetectOnPyramidTask(const ImagePyramid& pyramid_, const CascadeRun* runs_) : pyramid(pyramid_), runs(runs_) {}
+
+    void operator()(unsigned int i) const
+    {
+        const CascadeRun& run = runs[i];
+        detectOnPyramid(*run.classifier, pyramid, run.scale_factor, run.min_neighbours, run.min_size, run.max_size, *run.faces);
+    }
+
+    const ImagePyramid& pyramid;
+    const CascadeRun* runs;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// 3D position (in map frame) of the center of a face, using the median depth within the face roi
+bool getFacePosition(const ed::Measurement& msr, const cv::Rect& rgb_face_roi, geo::Vector3& point_map)
+{
+    const cv::Mat& color_image = msr.image()->getRGBImage();
+    const cv::Mat& depth_image = msr.image()->getDepthImage();
+
+    // Calculate size factor between depth and rgb images
+    double f_depth_rgb = (double)depth_image.cols / color_image.cols;
+
+    // Compute face roi for depth image
+    cv::Rect depth_face_roi(f_depth_rgb * rgb_face_roi.x, f_depth_rgb * rgb_face_roi.y,
+                            f_depth_rgb * rgb_face_roi.width, f_depth_rgb * rgb_face_roi.height);
+
+    cv::Mat face_area = depth_image(depth_face_roi);
+    float avg_depth = ed::perception::getMedianDepth(face_area);
+
+    if (avg_depth <= 0)
+        return false;
+
+    // calculate the center point of the face
+    cv::Point2i p_2d(depth_face_roi.x + depth_face_roi.width/2,
+                     depth_face_roi.y + depth_face_roi.height/2);
+
+    rgbd::View depth_view(*msr.image(), depth_image.cols);
+    geo::Vector3 projection = depth_view.getRasterizer().project2Dto3D(p_2d.x, p_2d.y) * avg_depth;
+    point_map = msr.sensorPose() * projection;
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// discard faces that are not close to the top of the region (false positives)
+void discardFacesBelowTop(int width, std::vector<cv::Rect>& faces)
+{
+    std::vector<cv::Rect>::iterator face_it = faces.begin();
+    for ( ; face_it != faces.end(); ) {
+        // allowed area is the full width and three times the size of the detected face
+        cv::Rect allowed_area (0, 0, width, face_it->height * 3);
+
+        // test if the rectangles intersect
+        if ( !(allowed_area & *face_it).area()) {
+            face_it = faces.erase(face_it);
+        }else
+            ++face_it;
+    }
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FaceDetector::FaceDetector() : ed::perception::BatchModule("face_detector")
 {
     this->registerPropertyServed("type");
     this->registerPropertyServed("name");
@@ -49,22 +225,51 @@ void FaceDetector::configureClassification(tue::Configuration config)
     classifier_profile_scale_factor_= 1.2;
     classifier_profile_min_neighbours_ = 3;
     classif_profile_min_size_ = cv::Size(20,20);
+    face_size_min_ = 0.10;
+    face_size_max_ = 0.35;
+    parallel_cascades_ = false;
+    face_tracking_ = false;
+    face_track_refresh_interval_ = 10;
+    face_track_min_correlation_ = 0.7;
+    face_track_max_misses_ = 3;
+    dnn_confidence_threshold_ = 0.5;
+    dnn_detector_.reset();
     debug_folder_ = "/tmp/face_detector/";
 
+    // select the face detection backend: Haar cascades (default) or a CNN detector
+    std::string backend = "cascade";
+    config.value("backend", backend, tue::OPTIONAL);
+
+    if (backend == "dnn")
+    {
+        std::string dnn_model_path, dnn_config_path;
+        int dnn_input_size = 300;
+        config.value("dnn_model_path", dnn_model_path);
+        config.value("dnn_config_path", dnn_config_path, tue::OPTIONAL);
+        config.value("dnn_input_size", dnn_input_size, tue::OPTIONAL);
+        config.value("dnn_confidence_threshold", dnn_confidence_threshold_, tue::OPTIONAL);
+
+        dnn_detector_.reset(new DnnFaceDetector);
+        if (!config.hasError() && !dnn_detector_->load(dnn_model_path, dnn_config_path, dnn_input_size))
+            config.addError("Unable to load dnn face detector (" + dnn_model_path + ")");
+    }
+    else if (backend != "cascade")
+    {
+        config.addError("Unknown face detection backend '" + backend + "', should be 'cascade' or 'dnn'");
+    }
+
     // load training files for frontal classifier
-    std::string cascade_front_files_path_;
-    if (config.value("cascade_front_files_path", cascade_front_files_path_))
+    if (!dnn_detector_ && config.value("cascade_front_files_path", cascade_front_path_))
     {
-        if (!classifier_front_.load(cascade_front_files_path_))
-            config.addError("Unable to load front haar cascade files (" + cascade_front_files_path_ + ")");
+        if (!ed::perception::CascadeRegistry::get(cascade_front_path_))
+            config.addError("Unable to load front haar cascade files (" + cascade_front_path_ + ")");
     }
 
     // load training files for profile classifier
-    std::string cascade_profile_files_path_;
-    if (config.value("cascade_profile_front_path", cascade_profile_files_path_))
+    if (!dnn_detector_ && config.value("cascade_profile_front_path", cascade_profile_path_))
     {
-        if (!classifier_profile_.load(cascade_profile_files_path_))
-            config.addError("Unable to load profile haar cascade files (" + cascade_profile_files_path_ + ")");
+        if (!ed::perception::CascadeRegistry::get(cascade_profile_path_))
+            config.addError("Unable to load profile haar cascade files (" + cascade_profile_path_ + ")");
     }
 
     if (config.hasError())
@@ -88,6 +293,34 @@ void FaceDetector::configureClassification(tue::Configuration config)
     if (!config.value("classifier_profile_min_neighbours", classifier_profile_min_neighbours_, tue::OPTIONAL))
         ed::log::info() << "Parameter 'classifier_profile_min_neighbours' not found. Using default: " << classifier_profile_min_neighbours_ << std::endl;
 
+    // the image pyramid is scaled down by these factors, so they must be larger than 1
+    if (classifier_front_scale_factor_ <= 1 || classifier_profile_scale_factor_ <= 1)
+    {
+        config.addError("Parameters 'classifier_front_scale_factor' and 'classifier_profile_scale_factor' must be larger than 1");
+        return;
+    }
+
+    if (!config.value("parallel_cascades", parallel_cascades_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'parallel_cascades' not found. Using default: " << parallel_cascades_ << std::endl;
+
+    if (!config.value("face_tracking", face_tracking_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_tracking' not found. Using default: " << face_tracking_ << std::endl;
+
+    if (!config.value("face_track_refresh_interval", face_track_refresh_interval_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_track_refresh_interval' not found. Using default: " << face_track_refresh_interval_ << std::endl;
+
+    if (!config.value("face_track_min_correlation", face_track_min_correlation_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_track_min_correlation' not found. Using default: " << face_track_min_correlation_ << std::endl;
+
+    if (!config.value("face_track_max_misses", face_track_max_misses_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_track_max_misses' not found. Using default: " << face_track_max_misses_ << std::endl;
+
+    if (!config.value("face_size_min", face_size_min_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_size_min' not found. Using default: " << face_size_min_ << std::endl;
+
+    if (!config.value("face_size_max", face_size_max_, tue::OPTIONAL))
+        ed::log::info() << "Parameter 'face_size_max' not found. Using default: " << face_size_max_ << std::endl;
+
     if (debug_mode_)
     {
         // clean the debug folder if debugging is active
@@ -114,68 +347,246 @@ void FaceDetector::configureClassification(tue::Configuration config)
 void FaceDetector::classify(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
                             ed::perception::ClassificationOutput& output) const
 {
-    if (property != "type" && property != "name")
+    if (dnn_detector_)
+    {
+        classifyWithDnn(std::vector<const ed::Entity*>(1, &e), property,
+                        std::vector<const ed::perception::CategoricalDistribution*>(1, &prior),
+                        std::vector<ed::perception::ClassificationOutput*>(1, &output));
         return;
+    }
+
+    cv::CascadeClassifier* classifier_front = ed::perception::CascadeRegistry::get(cascade_front_path_);
+    cv::CascadeClassifier* classifier_profile = ed::perception::CascadeRegistry::get(cascade_profile_path_);
+    if (!classifier_front || !classifier_profile)
+    {
+        ed::log::error() << "Unable to load haar cascade files (" << cascade_front_path_ << ", " << cascade_profile_path_
+                         << "), entity " << e.id() << " is not classified" << std::endl;
+        return;
+    }
+
+    classifyWithCascades(e, property, prior, output, *classifier_front, *classifier_profile);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FaceDetector::classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                                 const std::vector<ed::perception::CategoricalDistribution>& priors,
+                                 std::vector<ed::perception::ClassificationOutput>& outputs) const
+{
+    if (dnn_detector_)
+    {
+        // all entities go through the network in one inference call
+        outputs.resize(entities.size());
+
+        std::vector<const ed::Entity*> entity_ptrs(entities.size());
+        std::vector<const ed::perception::CategoricalDistribution*> prior_ptrs(entities.size());
+        std::vector<ed::perception::ClassificationOutput*> output_ptrs(entities.size());
+        for(unsigned int i = 0; i < entities.size(); ++i)
+        {
+            entity_ptrs[i] = entities[i].get();
+            prior_ptrs[i] = &priors[i];
+            output_ptrs[i] = &outputs[i];
+        }
+
+        classifyWithDnn(entity_ptrs, property, prior_ptrs, output_ptrs);
+        return;
+    }
+
+    classifyBatchParallel(entities, property, priors, outputs);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FaceDetector::prepareFaceSearch(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
+                                     FaceSearch& search) const
+{
+    if (property != "type" && property != "name")
+        return false;
 
     // If we already know that this is not going to be a human, skip face detection altogether
     double prior_human;
     if (prior.getScore("human", prior_human) && prior_human == 0)
-        return;
+        return false;
 
     // ---------- Prepare measurement ----------
 
     // Get the best measurement from the entity
-    ed::MeasurementConstPtr msr = e.lastMeasurement();
+    search.msr = e.lastMeasurement();
 
-    if (!msr)
-        return;
+    if (!search.msr)
+        return false;
 
     // get color image
-    const cv::Mat& color_image = msr->image()->getRGBImage();
-
-    // get depth image
-    const cv::Mat& depth_image = msr->image()->getDepthImage();
+    const cv::Mat& color_image = search.msr->image()->getRGBImage();
 
     // Mask color image
-    cv::Rect rgb_roi;
-    cv::Mat color_image_masked = ed::perception::maskImage(color_image, msr->imageMask(), rgb_roi);
+    search.color_image_masked = ed::perception::maskImage(color_image, search.msr->imageMask(), search.rgb_roi);
+
+    // ---------- Estimate face size ----------
+
+    // Limit the face size in pixels using the entity's depth, such that the cascades skip all scales at
+    // which no real face can appear. Empty sizes mean no limit.
+    search.face_min_size = cv::Size();
+    search.face_max_size = cv::Size();
+    if (face_size_max_ > 0)
+    {
+        float depth = ed::perception::getMedianDepth(*search.msr);
+        if (depth > 0)
+        {
+            rgbd::View view(*search.msr->image(), color_image.cols);
+            double fx = view.getRasterizer().getFocalLengthX();
+
+            int min_px = fx * face_size_min_ / depth;
+            int max_px = fx * face_size_max_ / depth + 1;
+
+            search.face_min_size = cv::Size(min_px, min_px);
+            search.face_max_size = cv::Size(max_px, max_px);
+        }
+    }
+
+    // ---------- Restrict search region ----------
+
+    // Faces are only accepted close to the top of the entity (see DetectFaces), so only search the band
+    // at the top of the crop that can contain such faces: the allowed area of three face heights, plus
+    // one face height for faces that start inside it. The band starts at row 0 of the crop, so face
+    // coordinates in the band are equal to those in the crop.
+    search.search_roi = search.rgb_roi;
+    if (search.face_max_size.height > 0)
+        search.search_roi.height = std::min(search.rgb_roi.height, 4 * search.face_max_size.height);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FaceDetector::classifyWithCascades(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
+                                        ed::perception::ClassificationOutput& output,
+                                        cv::CascadeClassifier& classifier_front, cv::CascadeClassifier& classifier_profile) const
+{
+    FaceSearch search;
+    if (!prepareFaceSearch(e, property, prior, search))
+        return;
 
     // ---------- Detect faces ----------
 
     std::vector<cv::Rect> faces_front;
     std::vector<cv::Rect> faces_profile;
 
-    // Detect faces in the measurment and assert the results
-    if (DetectFaces(color_image_masked(rgb_roi), faces_front, faces_profile))
+    // First try to follow the face found in a previous measurement of this entity. Only run the cascades
+    // if there is no track, the track is lost, or the track needs a refresh.
+    bool tracked = face_tracking_ && trackFace(e.id().str(), *search.msr, search.rgb_roi, faces_front, faces_profile);
+
+    if (tracked)
     {
-        // write face information to config if a frontal face was found
-        int face_counter = 0;
-        if (faces_front.size() > 0)
-        {
-            output.data.writeArray("faces_front");
-            writeFaceDetectionResult(*msr, rgb_roi, faces_front, face_counter, output.data);
-            output.data.endArray();
-        }
+        // the tracked face must satisfy the same rule as detected faces, otherwise fall back to detection
+        discardFacesBelowTop(search.rgb_roi.width, faces_front);
+        discardFacesBelowTop(search.rgb_roi.width, faces_profile);
+        tracked = !faces_front.empty() || !faces_profile.empty();
+    }
 
-        // write face information to config if a profile face was found
-        if (faces_profile.size() > 0)
-        {
-            output.data.writeArray("faces_profile");
-            writeFaceDetectionResult(*msr, rgb_roi, faces_profile, face_counter, output.data);
-            output.data.endArray();
-        }
+    if (!tracked)
+        DetectFaces(search.color_image_masked(search.search_roi), classifier_front, classifier_profile,
+                    search.face_min_size, search.face_max_size, faces_front, faces_profile);
 
-        if (property == "type")
-        {
-            output.likelihood.setScore("human", 1);
-        }
-        else if (property == "name")
+    assertFaces(e, property, search, faces_front, faces_profile, tracked, output);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FaceDetector::classifyWithDnn(const std::vector<const ed::Entity*>& entities, const std::string& property,
+                                   const std::vector<const ed::perception::CategoricalDistribution*>& priors,
+                                   const std::vector<ed::perception::ClassificationOutput*>& outputs) const
+{
+    std::vector<FaceSearch> searches(entities.size());
+    std::vector<std::vector<cv::Rect> > faces(entities.size());
+    std::vector<unsigned char> tracked(entities.size(), 0);
+
+    // Entities that still need detection, and their head band images
+    std::vector<unsigned int> detect_indices;
+    std::vector<cv::Mat> detect_images;
+
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        if (!prepareFaceSearch(*entities[i], property, *priors[i], searches[i]))
+            continue;
+
+        std::vector<cv::Rect> faces_profile;
+        if (face_tracking_ && trackFace(entities[i]->id().str(), *searches[i].msr, searches[i].rgb_roi, faces[i], faces_profile))
         {
-            if (!faces_front.empty())
+            // the network does not distinguish frontal and profile faces
+            faces[i].insert(faces[i].end(), faces_profile.begin(), faces_profile.end());
+
+            // the tracked face must satisfy the same rule as detected faces, otherwise fall back to detection
+            discardFacesBelowTop(searches[i].rgb_roi.width, faces[i]);
+            if (!faces[i].empty())
             {
-                recognizeFace(color_image_masked(rgb_roi), faces_front[0], output);
+                tracked[i] = 1;
+                continue;
             }
         }
+
+        detect_indices.push_back(i);
+        detect_images.push_back(searches[i].color_image_masked(searches[i].search_roi));
+    }
+
+    std::vector<std::vector<cv::Rect> > detected_faces;
+    dnn_detector_->detect(detect_images, dnn_confidence_threshold_, detected_faces);
+
+    for(unsigned int j = 0; j < detect_indices.size(); ++j)
+    {
+        unsigned int i = detect_indices[j];
+        faces[i] = detected_faces[j];
+        discardFacesBelowTop(searches[i].rgb_roi.width, faces[i]);
+    }
+
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        if (searches[i].msr)
+            assertFaces(*entities[i], property, searches[i], faces[i], std::vector<cv::Rect>(), tracked[i], *outputs[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FaceDetector::assertFaces(const ed::Entity& e, const std::string& property, const FaceSearch& search,
+                               const std::vector<cv::Rect>& faces_front, const std::vector<cv::Rect>& faces_profile,
+                               bool tracked, ed::perception::ClassificationOutput& output) const
+{
+    const ed::Measurement& msr = *search.msr;
+
+    if (face_tracking_)
+        updateFaceTrack(e.id().str(), msr, search.rgb_roi, faces_front, faces_profile, tracked);
+
+    if (faces_front.empty() && faces_profile.empty())
+        return;
+
+    // write face information to config if a frontal face was found
+    int face_counter = 0;
+    if (faces_front.size() > 0)
+    {
+        output.data.writeArray("faces_front");
+        writeFaceDetectionResult(msr, search.rgb_roi, faces_front, face_counter, output.data);
+        output.data.endArray();
+    }
+
+    // write face information to config if a profile face was found
+    if (faces_profile.size() > 0)
+    {
+        output.data.writeArray("faces_profile");
+        writeFaceDetectionResult(msr, search.rgb_roi, faces_profile, face_counter, output.data);
+        output.data.endArray();
+    }
+
+    if (property == "type")
+    {
+        output.likelihood.setScore("human", 1);
+    }
+    else if (property == "name")
+    {
+        if (!faces_front.empty())
+        {
+            recognizeFace(search.color_image_masked(search.rgb_roi), faces_front[0], output);
+        }
     }
 }
 
@@ -194,66 +605,77 @@ void FaceDetector::addTrainingInstance(const ed::Entity& e, const std::string& p
 // ----------------------------------------------------------------------------------------------------
 
 bool FaceDetector::DetectFaces(const cv::Mat& cropped_img,
+                               cv::CascadeClassifier& classifier_front,
+                               cv::CascadeClassifier& classifier_profile,
+                               const cv::Size& face_min_size,
+                               const cv::Size& face_max_size,
                                std::vector<cv::Rect>& faces_front,
                                std::vector<cv::Rect>& faces_profile) const{
 
+    // convert to grayscale and increase contrast once, for both cascades
     cv::Mat cascade_img;
-    std::vector<cv::Rect>::iterator face_it;
-
-    // create a copy of the image
-    cropped_img.copyTo(cascade_img);
+    if (cropped_img.channels() == 3)
+        cv::cvtColor(cropped_img, cascade_img, CV_BGR2GRAY);
+    else
+        cropped_img.copyTo(cascade_img);
 
-    // increase contrast of the image
     normalize(cascade_img, cascade_img, 0, 255, cv::NORM_MINMAX, CV_8UC1);
 
-
-
-    // detect frontal faces
-    classifier_front_.detectMultiScale(cascade_img,
-                                            faces_front,
-                                            classifier_front_scale_factor_,
-                                            classifier_front_min_neighbours_,
-                                            0|CV_HAAR_SCALE_IMAGE,
-                                            classif_front_min_size_);
-
-    // discard face if its not close to the top of the region, false positive
-    face_it = faces_front.begin();
-    for ( ; face_it != faces_front.end(); ) {
-        // allowed area is the full width and three times the size of the detected face
-        cv::Rect allowed_area (0, 0, cropped_img.cols, face_it->height * 3);
-
-        // test if the rectangles intersect
-        if ( !(allowed_area & *face_it).area()) {
-            face_it = faces_front.erase(face_it);
-        }else
-            ++face_it;
+    // combine the configured minimum sizes with the expected face size
+    cv::Size front_min_size(std::max(classif_front_min_size_.width, face_min_size.width),
+                            std::max(classif_front_min_size_.height, face_min_size.height));
+    cv::Size profile_min_size(std::max(classif_profile_min_size_.width, face_min_size.width),
+                              std::max(classif_profile_min_size_.height, face_min_size.height));
+
+    // if the expected faces are smaller than the minimum detection size, do not limit the maximum size
+    cv::Size front_max_size, profile_max_size;
+    if (face_max_size.width >= front_min_size.width && face_max_size.height >= front_min_size.height)
+        front_max_size = face_max_size;
+    if (face_max_size.width >= profile_min_size.width && face_max_size.height >= profile_min_size.height)
+        profile_max_size = face_max_size;
+
+    // Build one image pyramid, shared by both cascades, with the smaller (finer) of the two scale factors. Each
+    // cascade evaluates only the levels that match its own scale factor (see detectOnPyramid). Only the resized
+    // images are shared: each cascade still computes its own integral images per level.
+    cv::Size front_window = classifier_front.getOriginalWindowSize();
+    cv::Size profile_window = classifier_profile.getOriginalWindowSize();
+    cv::Size min_window(std::min(front_window.width, profile_window.width), std::min(front_window.height, profile_window.height));
+
+    ImagePyramid pyramid;
+    double min_scale = std::min((double)front_min_size.width / front_window.width, (double)profile_min_size.width / profile_window.width);
+    buildPyramid(cascade_img, std::min(classifier_front_scale_factor_, classifier_profile_scale_factor_), min_window, min_scale, pyramid);
+
+    if (parallel_cascades_)
+    {
+        // run both cascades at the same time on the thread pool. The profile result is only used if no frontal
+        // faces are found. Each classifier is used by one thread at a time: the calling thread only works on
+        // this job while it waits for it.
+        CascadeRun runs[2] = {
+            { &classifier_front, classifier_front_scale_factor_, classifier_front_min_neighbours_, front_min_size, front_max_size, &faces_front },
+            { &classifier_profile, classifier_profile_scale_factor_, classifier_profile_min_neighbours_, profile_min_size, profile_max_size, &faces_profile }
+        };
+        ed::perception::parallelFor(2, DetectOnPyramidTask(pyramid, runs));
+
+        discardFacesBelowTop(cropped_img.cols, faces_front);
+        if (faces_front.empty())
+            discardFacesBelowTop(cropped_img.cols, faces_profile);
+        else
+            faces_profile.clear();
     }
-
-    // only search profile faces if the frontal face detection failed
-    if (faces_front.empty())
+    else
     {
-        classifier_profile_.detectMultiScale(cascade_img,
-                                                  faces_profile,
-                                                  classifier_profile_scale_factor_,
-                                                  classifier_profile_min_neighbours_,
-                                                  0|CV_HAAR_SCALE_IMAGE,
-                                                  classif_profile_min_size_);
-
-        // discard face if its not close to the top of the region, false positive
-        face_it = faces_profile.begin();
-        for ( ; face_it != faces_profile.end(); ) {
-            // allowed area is the full width and three times the size of the detected face
-            cv::Rect allowed_area (0, 0, cropped_img.cols, face_it->height * 3);
+        // detect frontal faces
+        detectOnPyramid(classifier_front, pyramid, classifier_front_scale_factor_, classifier_front_min_neighbours_, front_min_size, front_max_size, faces_front);
+        discardFacesBelowTop(cropped_img.cols, faces_front);
 
-            // test if the rectangles intersect
-            if ( !(allowed_area & *face_it).area()) {
-                face_it = faces_profile.erase(face_it);
-            }else
-                ++face_it;
+        // only search profile faces if the frontal face detection failed
+        if (faces_front.empty())
+        {
+            detectOnPyramid(classifier_profile, pyramid, classifier_profile_scale_factor_, classifier_profile_min_neighbours_, profile_min_size, profile_max_size, faces_profile);
+            discardFacesBelowTop(cropped_img.cols, faces_profile);
         }
     }
 
-
     // if debug mode is active and faces were found
     if (debug_mode_)
     {
@@ -276,6 +698,131 @@ bool FaceDetector::DetectFaces(const cv::Mat& cropped_img,
 
 // ----------------------------------------------------------------------------------------------------
 
+bool FaceDetector::trackFace(const std::string& id, const ed::Measurement& msr, const cv::Rect& rgb_roi,
+                             std::vector<cv::Rect>& faces_front, std::vector<cv::Rect>& faces_profile) const
+{
+    FaceTrack track;
+
+    {
+        boost::lock_guard<boost::mutex> lg(face_tracks_mutex_);
+
+        std::map<std::string, FaceTrack>::const_iterator it = face_tracks_.find(id);
+        if (it == face_tracks_.end() || it->second.num_tracked >= face_track_refresh_interval_)
+            return false;
+
+        track = it->second;
+    }
+
+    const cv::Mat& color_image = msr.image()->getRGBImage();
+
+    // project the previous face position into the current image
+    rgbd::View view(*msr.image(), color_image.cols);
+    cv::Point2d center = view.getRasterizer().project3Dto2D(msr.sensorPose().inverse() * track.position);
+
+    // search window of twice the face size around the projected position, within the entity's roi
+    cv::Rect window(center.x - track.patch.cols, center.y - track.patch.rows, 2 * track.patch.cols, 2 * track.patch.rows);
+    window &= rgb_roi;
+
+    if (window.width < track.patch.cols || window.height < track.patch.rows)
+        return false;
+
+    cv::Mat window_gray;
+    cv::cvtColor(color_image(window), window_gray, CV_BGR2GRAY);
+
+    cv::Mat correlation;
+    cv::matchTemplate(window_gray, track.patch, correlation, CV_TM_CCOEFF_NORMED);
+
+    double max_correlation;
+    cv::Point max_loc;
+    cv::minMaxLoc(correlation, 0, &max_correlation, 0, &max_loc);
+
+    if (max_correlation < face_track_min_correlation_)
+        return false;
+
+    // face roi in crop coordinates
+    cv::Rect face(window.x + max_loc.x - rgb_roi.x, window.y + max_loc.y - rgb_roi.y, track.patch.cols, track.patch.rows);
+
+    if (track.front)
+        faces_front.push_back(face);
+    else
+        faces_profile.push_back(face);
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void FaceDetector::updateFaceTrack(const std::string& id, const ed::Measurement& msr, const cv::Rect& rgb_roi,
+                                   const std::vector<cv::Rect>& faces_front, const std::vector<cv::Rect>& faces_profile,
+                                   bool tracked) const
+{
+    double timestamp = msr.image()->getTimestamp();
+
+    boost::lock_guard<boost::mutex> lg(face_tracks_mutex_);
+
+    // forget tracks of entities that were not seen for a while
+    for(std::map<std::string, FaceTrack>::iterator it = face_tracks_.begin(); it != face_tracks_.end(); )
+    {
+        if (it->second.timestamp < timestamp - FACE_TRACK_TIMEOUT)
+            face_tracks_.erase(it++);
+        else
+            ++it;
+    }
+
+    std::map<std::string, FaceTrack>::iterator track_it = face_tracks_.find(id);
+
+    bool front = !faces_front.empty();
+    if (!front && faces_profile.empty())
+    {
+        // The detector did not find a face. Keep following the face with the last detected patch, unless
+        // the detector missed it too often in a row.
+        if (track_it != face_tracks_.end())
+        {
+            FaceTrack& track = track_it->second;
+            track.num_tracked = 0;
+            if (++track.num_missed >= face_track_max_misses_)
+                face_tracks_.erase(track_it);
+        }
+        return;
+    }
+
+    cv::Rect face = front ? faces_front[0] : faces_profile[0];
+    face.x += rgb_roi.x;
+    face.y += rgb_roi.y;
+
+    geo::Vector3 position;
+    if (!getFacePosition(msr, face, position))
+    {
+        face_tracks_.erase(id);
+        return;
+    }
+
+    if (tracked)
+    {
+        // the track may have timed out in the meantime
+        if (track_it == face_tracks_.end())
+            return;
+
+        // follow the face, but keep the patch of the last detection such that the track does not drift
+        FaceTrack& track = track_it->second;
+        ++track.num_tracked;
+        track.position = position;
+        track.timestamp = timestamp;
+        return;
+    }
+
+    // detected: (re-)anchor the track
+    FaceTrack& track = face_tracks_[id];
+    track.num_tracked = 0;
+    track.num_missed = 0;
+    track.position = position;
+    track.front = front;
+    track.timestamp = timestamp;
+    cv::cvtColor(msr.image()->getRGBImage()(face), track.patch, CV_BGR2GRAY);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 void FaceDetector::recognizeFace(const cv::Mat& image, const cv::Rect& roi, ed::perception::ClassificationOutput& output) const
 {
     if (face_data_.empty())
@@ -307,9 +854,6 @@ void FaceDetector::writeFaceDetectionResult(const ed::Measurement& msr, const cv
     // Calculate size factor between depth and rgb images
     double f_depth_rgb = (double)depth_image.cols / color_image.cols;
 
-    // Create depth view
-    rgbd::View depth_view(*msr.image(), depth_image.cols);
-
     for (uint j = 0; j < rgb_face_rois.size(); j++)
     {
         cv::Rect rgb_face_roi = rgb_face_rois[j];
@@ -329,25 +873,18 @@ void FaceDetector::writeFaceDetectionResult(const ed::Measurement& msr, const cv
         result.setValue("width", rgb_face_roi.width);
         result.setValue("height", rgb_face_roi.height);
 
-        // Compute face roi for depth image
-        cv::Rect depth_face_roi(f_depth_rgb * rgb_face_roi.x, f_depth_rgb * rgb_face_roi.y,
-                                f_depth_rgb * rgb_face_roi.width, f_depth_rgb * rgb_face_roi.height);
-
         if (debug_mode_)
-            ed::perception::saveDebugImage("face_detector-depth", depth_image(depth_face_roi));
-
-        cv::Mat face_area = depth_image(depth_face_roi);
-        float avg_depth = ed::perception::getMedianDepth(face_area);
-
-        if (avg_depth > 0)
         {
-            // calculate the center point of the face
-            cv::Point2i p_2d(depth_face_roi.x + depth_face_roi.width/2,
-                             depth_face_roi.y + depth_face_roi.height/2);
+            // Compute face roi for depth image
+            cv::Rect depth_face_roi(f_depth_rgb * rgb_face_roi.x, f_depth_rgb * rgb_face_roi.y,
+                                    f_depth_rgb * rgb_face_roi.width, f_depth_rgb * rgb_face_roi.height);
 
-            geo::Vector3 projection = depth_view.getRasterizer().project2Dto3D(p_2d.x, p_2d.y) * avg_depth;
-            geo::Vector3 point_map = msr.sensorPose() * projection;
+            ed::perception::saveDebugImage("face_detector-depth", depth_image(depth_face_roi));
+        }
 
+        geo::Vector3 point_map;
+        if (getFacePosition(msr, rgb_face_roi, point_map))
+        {
             // add 3D location of the face
             result.setValue("map_x", point_map.x);
             result.setValue("map_y", point_map.y);
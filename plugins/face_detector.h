@@ -7,7 +7,12 @@
 #ifndef ED_PERCEPTION_FACE_DETECTOR_H_
 #define ED_PERCEPTION_FACE_DETECTOR_H_
 
-#include <ed/perception/module.h>
+#include "batch_module.h"
+
+#include <geolib/datatypes.h>
+
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 
 // OpenCV includes
 #include <opencv/cv.h>
@@ -15,7 +20,9 @@
 #include "opencv2/imgproc/imgproc.hpp"
 #include "opencv2/objdetect/objdetect.hpp"
 
-class FaceDetector : public ed::perception::Module
+class DnnFaceDetector;
+
+class FaceDetector : public ed::perception::BatchModule
 {
 
 /*
@@ -38,14 +45,90 @@ private:
     int classifier_profile_min_neighbours_;    // Parameter specifying how many neighbors each candidate rectangle should have to retain it.
     cv::Size classif_profile_min_size_;   // Minimum possible object size. Objects smaller than that are ignored.
 
-    // Haar cascade classifiers
-    mutable cv::CascadeClassifier classifier_front_;
-    mutable cv::CascadeClassifier classifier_profile_;
+    // Metric face size band (in meters), used to limit the cascade scales based on the entity's depth
+    double face_size_min_;
+    double face_size_max_;
+
+    // Run the frontal and profile cascades in parallel (on the thread pool, see parallelFor)
+    bool parallel_cascades_;
+
+    // Face tracking: follow a detected face over measurements of the same entity using template matching,
+    // and only run the cascades when the track is lost or every 'face_track_refresh_interval_' measurements.
+    // The track is dropped when the cascades miss the face 'face_track_max_misses_' times in a row.
+    struct FaceTrack
+    {
+        geo::Vector3 position;  // face center in map frame
+        cv::Mat patch;          // grayscale image of the face at the last cascade detection
+        bool front;             // frontal or profile face
+        int num_tracked;        // number of measurements tracked since the last cascade detection
+        int num_missed;         // number of cascade detections in a row that did not find a face
+        double timestamp;
+    };
+
+    bool face_tracking_;
+    int face_track_refresh_interval_;
+    double face_track_min_correlation_;
+    int face_track_max_misses_;
+
+    mutable boost::mutex face_tracks_mutex_;
+    mutable std::map<std::string, FaceTrack> face_tracks_;
+
+    // find the face of the entity's track in the measurement, true if found. Faces are in roi coordinates
+    bool trackFace(const std::string& id, const ed::Measurement& msr, const cv::Rect& rgb_roi,
+                   std::vector<cv::Rect>& faces_front, std::vector<cv::Rect>& faces_profile) const;
+
+    // update (or remove) the entity's track with the faces found in the measurement
+    void updateFaceTrack(const std::string& id, const ed::Measurement& msr, const cv::Rect& rgb_roi,
+                         const std::vector<cv::Rect>& faces_front, const std::vector<cv::Rect>& faces_profile,
+                         bool tracked) const;
+
+    // Haar cascade classifiers (see CascadeRegistry)
+    std::string cascade_front_path_;
+    std::string cascade_profile_path_;
+
+    // CNN face detector, used instead of the cascades if the 'dnn' backend is configured
+    boost::shared_ptr<DnnFaceDetector> dnn_detector_;
+    float dnn_confidence_threshold_;
 
     //------------------------------------
 
+    // Measurement of an entity, prepared for face detection
+    struct FaceSearch
+    {
+        ed::MeasurementConstPtr msr;
+        cv::Mat color_image_masked;
+        cv::Rect rgb_roi;           // bounding box of the entity's mask
+        cv::Rect search_roi;        // head band at the top of rgb_roi
+        cv::Size face_min_size;     // expected face size range based on depth, empty if unknown
+        cv::Size face_max_size;
+    };
+
+    // prepares the entity for face detection, false if faces should not be searched
+    bool prepareFaceSearch(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
+                           FaceSearch& search) const;
+
+    // updates the face track and writes the faces found to the output
+    void assertFaces(const ed::Entity& e, const std::string& property, const FaceSearch& search,
+                     const std::vector<cv::Rect>& faces_front, const std::vector<cv::Rect>& faces_profile,
+                     bool tracked, ed::perception::ClassificationOutput& output) const;
+
+    // classify all entities using one inference call of the CNN face detector (classify passes one entity,
+    // classifyBatch the whole batch)
+    void classifyWithDnn(const std::vector<const ed::Entity*>& entities, const std::string& property,
+                         const std::vector<const ed::perception::CategoricalDistribution*>& priors,
+                         const std::vector<ed::perception::ClassificationOutput*>& outputs) const;
+
+    // classify using the given cascade classifiers
+    void classifyWithCascades(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
+                              ed::perception::ClassificationOutput& output,
+                              cv::CascadeClassifier& classifier_front, cv::CascadeClassifier& classifier_profile) const;
+
     // detect frontal and profile faces on an image, true if a face was detected
     bool DetectFaces(const cv::Mat &cropped_img,
+                     cv::CascadeClassifier& classifier_front,
+                     cv::CascadeClassifier& classifier_profile,
+                     const cv::Size& face_min_size,
+                     const cv::Size& face_max_size,
                      std::vector<cv::Rect> &faces_front,
                      std::vector<cv::Rect> &faces_profile) const;
 
@@ -70,6 +153,13 @@ public:
     void classify(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
                   ed::perception::ClassificationOutput& output) const;
 
+    // With the dnn backend, the head bands of all entities are detected in one inference call. With the
+    // cascades, the entities are classified in parallel. The threads of the pool keep their cascade instances
+    // (see CascadeRegistry), so no cascades are loaded per batch.
+    void classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                       const std::vector<ed::perception::CategoricalDistribution>& priors,
+                       std::vector<ed::perception::ClassificationOutput>& outputs) const;
+
     void addTrainingInstance(const ed::Entity& e, const std::string& property, const std::string& value);
 
     void train() {}
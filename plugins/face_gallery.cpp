@@ -0,0 +1,289 @@
+#include "face_gallery.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace
+{
+
+// Header of the binary face gallery. It is followed by:
+//  - num_faces x (int32 label, int32 rows, int32 cols, int32 type, image data)
+//  - num_names x (int32 label, uint32 length, characters)
+//  - num_histogram_groups x (int32 label, uint32 count, uint32 size, count x size floats)
+struct BinaryHeader
+{
+    char magic[4];          // "EDFG"
+    uint32_t version;
+    uint32_t num_faces;
+    uint32_t num_names;
+    uint32_t num_histogram_groups;
+};
+
+const uint32_t BINARY_VERSION = 1;
+
+// Reads from a memory block, checking that it does not read beyond its end
+class Reader
+{
+
+public:
+
+    Reader(const char* data, size_t size) : ptr_(data), end_(data + size) {}
+
+    template<typename T>
+    bool read(T& value)
+    {
+        if (!check(sizeof(T)))
+            return false;
+
+        std::memcpy(&value, ptr_, sizeof(T));
+        ptr_ += sizeof(T);
+        return true;
+    }
+
+    bool read(std::string& s, uint32_t length)
+    {
+        if (!check(length))
+            return false;
+
+        s.assign(ptr_, length);
+        ptr_ += length;
+        return true;
+    }
+
+    // Returns a pointer to the next 'size' bytes and skips them, or 0 if there are not that many left
+    const char* skip(size_t size)
+    {
+        if (!check(size))
+            return 0;
+
+        const char* p = ptr_;
+        ptr_ += size;
+        return p;
+    }
+
+    bool atEnd() const { return ptr_ == end_; }
+
+private:
+
+    bool check(size_t size) const { return (size_t)(end_ - ptr_) >= size; }
+
+    const char* ptr_;
+    const char* end_;
+
+};
+
+template<typename T>
+void write(std::ofstream& file, const T& value)
+{
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+void writeString(std::ofstream& file, const std::string& s)
+{
+    write(file, (uint32_t)s.size());
+    file.write(s.data(), s.size());
+}
+
+void writeMatData(std::ofstream& file, const cv::Mat& m)
+{
+    for(int y = 0; y < m.rows; ++y)
+        file.write(reinterpret_cast<const char*>(m.ptr(y)), m.cols * m.elemSize());
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FaceGallery::FaceGallery()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+FaceGallery::~FaceGallery()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FaceGallery::readFromFile(const std::string& filename)
+{
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(BinaryHeader))
+    {
+        close(fd);
+        return false;
+    }
+
+    void* map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return false;
+
+    Reader reader(static_cast<const char*>(map), st.st_size);
+
+    BinaryHeader header;
+    reader.read(header);
+
+    bool ok = std::strncmp(header.magic, "EDFG", 4) == 0 && header.version == BINARY_VERSION;
+
+    images.clear();
+    labels.clear();
+    names.clear();
+    histograms.clear();
+
+    // Faces
+    for(uint32_t i = 0; ok && i < header.num_faces; ++i)
+    {
+        int32_t label, rows, cols, type;
+        ok = reader.read(label) && reader.read(rows) && reader.read(cols) && reader.read(type)
+                && rows >= 0 && cols >= 0 && type == CV_MAT_TYPE(type) && CV_MAT_DEPTH(type) <= CV_64F;
+
+        const char* data = ok ? reader.skip((size_t)rows * cols * CV_ELEM_SIZE(type)) : 0;
+        if (!data)
+        {
+            ok = false;
+            break;
+        }
+
+        images.push_back(cv::Mat(rows, cols, type, const_cast<char*>(data)).clone());
+        labels.push_back(label);
+    }
+
+    // Names
+    for(uint32_t i = 0; ok && i < header.num_names; ++i)
+    {
+        int32_t label;
+        uint32_t length;
+        std::string name;
+        ok = reader.read(label) && reader.read(length) && reader.read(name, length);
+        if (ok)
+            names[label] = name;
+    }
+
+    // Histograms
+    for(uint32_t i = 0; ok && i < header.num_histogram_groups; ++i)
+    {
+        int32_t label;
+        uint32_t count, size;
+        ok = reader.read(label) && reader.read(count) && reader.read(size);
+
+        const char* data = ok ? reader.skip((size_t)count * size * sizeof(float)) : 0;
+        if (!data)
+        {
+            ok = false;
+            break;
+        }
+
+        std::vector<cv::Mat>& hists = histograms[label];
+        for(uint32_t j = 0; j < count; ++j)
+            hists.push_back(cv::Mat(1, size, CV_32FC1, const_cast<char*>(data) + j * size * sizeof(float)).clone());
+    }
+
+    ok = ok && reader.atEnd();
+
+    munmap(map, st.st_size);
+
+    return ok;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FaceGallery::writeToFile(const std::string& filename) const
+{
+    std::string tmp_filename = filename + ".tmp";
+
+    bool ok;
+    {
+        std::ofstream file(tmp_filename.c_str(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+        if (!file.is_open())
+            return false;
+
+        ok = writeData(file);
+
+        file.close();
+        ok = ok && !file.fail();
+    }
+
+    // make sure the data is on disk before the rename makes it the gallery
+    if (ok)
+    {
+        int fd = open(tmp_filename.c_str(), O_WRONLY);
+        ok = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+    }
+
+    if (!ok || std::rename(tmp_filename.c_str(), filename.c_str()) != 0)
+    {
+        std::remove(tmp_filename.c_str());
+        return false;
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool FaceGallery::writeData(std::ofstream& file) const
+{
+    if (images.size() != labels.size())
+        return false;
+
+    BinaryHeader header;
+    std::memcpy(header.magic, "EDFG", 4);
+    header.version = BINARY_VERSION;
+    header.num_faces = images.size();
+    header.num_names = names.size();
+    header.num_histogram_groups = histograms.size();
+    write(file, header);
+
+    for(unsigned int i = 0; i < images.size(); ++i)
+    {
+        const cv::Mat& img = images[i];
+        write(file, (int32_t)labels[i]);
+        write(file, (int32_t)img.rows);
+        write(file, (int32_t)img.cols);
+        write(file, (int32_t)img.type());
+        writeMatData(file, img);
+    }
+
+    for(std::map<int, std::string>::const_iterator it = names.begin(); it != names.end(); ++it)
+    {
+        write(file, (int32_t)it->first);
+        writeString(file, it->second);
+    }
+
+    for(std::map<int, std::vector<cv::Mat> >::const_iterator it = histograms.begin(); it != histograms.end(); ++it)
+    {
+        const std::vector<cv::Mat>& hists = it->second;
+        uint32_t size = hists.empty() ? 0 : hists[0].total();
+
+        for(unsigned int j = 0; j < hists.size(); ++j)
+        {
+            if (hists[j].type() != CV_32FC1 || hists[j].total() != size)
+                return false;
+        }
+
+        write(file, (int32_t)it->first);
+        write(file, (uint32_t)hists.size());
+        write(file, size);
+
+        for(unsigned int j = 0; j < hists.size(); ++j)
+            writeMatData(file, hists[j].reshape(1, 1));
+    }
+
+    return file.good();
+}
@@ -0,0 +1,41 @@
+#ifndef ED_PERCEPTION_FACE_GALLERY_H_
+#define ED_PERCEPTION_FACE_GALLERY_H_
+
+#include <opencv2/core/core.hpp>
+
+#include <fstream>
+#include <map>
+#include <string>
+#include <vector>
+
+// Everything FaceRecognition learned: the aligned faces with their labels, and the names and clothing color
+// histograms per label. Stored in a single versioned binary file, which is mapped into memory when read.
+// The trained FaceRecognizers are not stored: OpenCV can only restore them from (slow to parse) text, so they
+// are retrained from the faces instead.
+class FaceGallery
+{
+
+public:
+
+    FaceGallery();
+
+    ~FaceGallery();
+
+    bool readFromFile(const std::string& filename);
+
+    // Writes to a temporary file first, which is synced to disk and then renamed, so the file is either the old
+    // or the new gallery, also if writing is interrupted or the system crashes.
+    bool writeToFile(const std::string& filename) const;
+
+    std::vector<cv::Mat> images;                            // aligned faces
+    std::vector<int> labels;                                // label of each face
+    std::map<int, std::string> names;                       // person name per label
+    std::map<int, std::vector<cv::Mat> > histograms;        // clothing color histograms (1 x n, CV_32FC1) per label
+
+private:
+
+    bool writeData(std::ofstream& file) const;
+
+};
+
+#endif
@@ -5,6 +5,10 @@
 */
 
 #include "face_recognition.h"
+#include "cascade_registry.h"
+#include "face_gallery.h"
+#include "histogram_distance.h"
+#include "parallel_for.h"
 
 #include "ed/measurement.h"
 #include <ed/entity.h>
@@ -16,6 +20,7 @@
 #include <ros/node_handle.h>
 #include <ros/advertise_service_options.h>
 
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/lexical_cast.hpp>
 
@@ -26,13 +31,24 @@
 
 #include <actionlib/server/action_server.h>
 
+namespace
+{
+
+// time (in seconds) after which an enrollment session is unbound from an entity that is no longer seen
+const double ENROLLMENT_TIMEOUT = 10;
+
+}
+
 
 // ----------------------------------------------------------------------------------------------------
 
 FaceRecognition::FaceRecognition() :
     ed::perception::Module("face_recognition"),
     as_(0),
-    init_success_(false)
+    init_success_(false),
+    n_images_LBPH_(0),
+    training_running_(false),
+    training_pending_(false)
 {
 
 }
@@ -42,6 +58,10 @@ FaceRecognition::FaceRecognition() :
 
 FaceRecognition::~FaceRecognition(){
 
+    // training uses the members of this module, so wait for it to finish
+    if (training_thread_.joinable())
+        training_thread_.join();
+
     if (debug_mode_){
         cv::destroyWindow("Face Recognition debug");
     }
@@ -86,6 +106,18 @@ void FaceRecognition::configure(tue::Configuration config) {
     if (!config.value("lbph_treshold", lbph_treshold_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'lbph_treshold' not found. Using default: " << lbph_treshold_ << std::endl;
 
+    if (!config.value("lbph_index_min_size", lbph_index_min_size_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'lbph_index_min_size' not found. Using default: " << lbph_index_min_size_ << std::endl;
+
+    if (!config.value("lbph_index_candidates", lbph_index_candidates_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'lbph_index_candidates' not found. Using default: " << lbph_index_candidates_ << std::endl;
+
+    if (!config.value("lbph_index_max_checks", lbph_index_max_checks_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'lbph_index_max_checks' not found. Using default: " << lbph_index_max_checks_ << std::endl;
+
+    lbph_index_.setNumCandidates(std::max(1, lbph_index_candidates_));
+    lbph_index_.setMaxChecks(std::max(0, lbph_index_max_checks_));
+
     if (!config.value("recognition_treshold", recognition_treshold_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'recognition_treshold' not found. Using default: " << recognition_treshold_ << std::endl;
 
@@ -101,6 +133,15 @@ void FaceRecognition::configure(tue::Configuration config) {
     if (!config.value("max_faces_learn", max_faces_learn_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'max_faces_learn' not found. Using default: " << max_faces_learn_ << std::endl;
 
+    if (!config.value("max_enrollment_sessions", max_enrollment_sessions_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'max_enrollment_sessions' not found. Using default: " << max_enrollment_sessions_ << std::endl;
+
+    if (config.value("cascade_left_eye_path", cascade_left_eye_path_, tue::OPTIONAL) && !ed::perception::CascadeRegistry::get(cascade_left_eye_path_))
+        std::cout << "[" << module_name_ << "] " << "Unable to load left eye haar cascade file (" << cascade_left_eye_path_ << ")" << std::endl;
+
+    if (config.value("cascade_right_eye_path", cascade_right_eye_path_, tue::OPTIONAL) && !ed::perception::CascadeRegistry::get(cascade_right_eye_path_))
+        std::cout << "[" << module_name_ << "] " << "Unable to load right eye haar cascade file (" << cascade_right_eye_path_ << ")" << std::endl;
+
     saved_faces_dir_ = (std::string)getenv("HOME") + saved_faces_dir_;
 
     // create debug window
@@ -108,15 +149,21 @@ void FaceRecognition::configure(tue::Configuration config) {
         cv::namedWindow("Face Recognition debug", cv::WINDOW_AUTOSIZE);
     }
 
-    // Get the path to the CSV file and images
-    std::string csv_file_path = saved_faces_dir_ + "face_models.cvs";
-
-    // Load faces from CSV file
-    if (!csv_file_path.empty()){
-        readCSV(csv_file_path, images_, labels_, labels_info_);
-        trainRecognizers(images_, labels_, models_);
-    }else {
-        std::cout << "[" << module_name_ << "] " << "No CSV faces file was loaded! Recognizers not trained" << std::endl;
+    // Load faces from the binary gallery, or else from the CSV file and images (which are then converted to a gallery)
+    bool gallery_loaded = loadGallery(saved_faces_dir_ + "face_gallery.bin");
+    if (gallery_loaded){
+        std::cout << "[" << module_name_ << "] " << "Loaded gallery with " << images_.size() << " images for " << labels_info_.size() << " different people." << std::endl;
+    }else{
+        // Get the path to the CSV file and images
+        std::string csv_file_path = saved_faces_dir_ + "face_models.cvs";
+
+        // Load faces from CSV file
+        if (!csv_file_path.empty()){
+            readCSV(csv_file_path, images_, labels_, labels_info_);
+            trainRecognizers(images_, labels_, models_);
+        }else {
+            std::cout << "[" << module_name_ << "] " << "No CSV faces file was loaded! Recognizers not trained" << std::endl;
+        }
     }
 
     // create faces folder
@@ -124,6 +171,10 @@ void FaceRecognition::configure(tue::Configuration config) {
         boost::filesystem::path dir(saved_faces_dir_);
         boost::filesystem::create_directories(dir);
         std::cout << "[" << module_name_ << "] " << "Faces learned will be saved in: " << saved_faces_dir_ << std::endl;
+
+        // faces loaded from the CSV file are converted to a gallery
+        if (!images_.empty() && !gallery_loaded && !saveGallery(getGallery(), saved_faces_dir_ + "face_gallery.bin"))
+            std::cout << "[" << module_name_ << "] " << "Could not save gallery in " << saved_faces_dir_ << std::endl;
     }
 
     if (enable_learning_service_){
@@ -178,11 +229,14 @@ void FaceRecognition::loadConfig(const std::string& config_path) {
     eigen_treshold_ = 3500;
     fisher_treshold_ = 800;
     lbph_treshold_ = 45;
+    lbph_index_min_size_ = 200;
+    lbph_index_candidates_ = 10;
+    lbph_index_max_checks_ = 0;
     recognition_treshold_ = 0.95;
     face_target_size_ = 150;
     face_vert_offset_ = 0.35;
     face_horiz_offset_ = 0.25;
-    learning_mode_ = false;
+    max_enrollment_sessions_ = 4;
     max_faces_learn_ = 10;
 
     // ---------------- INITIALIZATIONS ----------------
@@ -241,6 +295,9 @@ void FaceRecognition::process(const ed::perception::WorkerInput& input, ed::perc
         cb_queue_.callAvailable();
     }
 
+    // restart background training if faces were learned while it was running, or save what was learned
+    checkBackgroundTraining();
+
     if (!isFaceFound(config.limitScope())){
 //        std::cout << "[" << module_name_ << "] " << "Couldn't find a face, skipping recognition"<< std::endl;
         return;
@@ -286,93 +343,22 @@ void FaceRecognition::process(const ed::perception::WorkerInput& input, ed::perc
     }
 
 
-    // ---------- Learning (if active)----------
-    if (learning_mode_){
-        std::cout << "[" << module_name_ << "] " << "In learning mode..." << std::endl;
-
-        int largest_face_idx = 0;
-        int biggest_area = 0;
-
-        ed::ErrorContext errc("Learning mode started in FaceRecognition");
-
-//        face_match_result = learning_name_;
-//        face_confidence_match = 0;
-
-        // get biggest face available
-        for (uint i=0 ; i<faces_detected.size() ; i++){
-            if (faces_detected[i].features.width * faces_detected[i].features.height > biggest_area){
-                biggest_area = faces_detected[i].features.width * faces_detected[i].features.height;
-                largest_face_idx = i;
-            }
-        }
-
-        // true when learning is complete
-        if (learnFace(learning_name_, last_label_, faces_detected[largest_face_idx].face_img, entity_histogram, n_faces_current_, images_, labels_, labels_info_)){
-            ed_perception::FaceLearningResult learning_result_;
-
-            // reset number of learned faces
-            n_faces_current_ = 0;
-
-            // update last label number
-            last_label_++;
-
-            // retrain FaceRecognizers
-            trainRecognizers(images_, labels_, models_);
-
-            // quit learning mode
-            learning_mode_ = false;
-
-            if (as_->isActive()){
-                learning_result_.result_info = "Learning complete";
-                as_->setSucceeded(learning_result_);
-            }
-
-            std::cout << "[" << module_name_ << "] " << "Learning complete!" << std::endl;
-
-        }else{
-            // update number of faces learned
-            n_faces_current_ ++;
-
-            if (as_->isActive()){
-                ed_perception::FaceLearningFeedback learning_feedback_;
-                learning_feedback_.faces_learned = n_faces_current_;
-                as_->publishFeedback(learning_feedback_);
-            }
-        }
-    }
+    // ---------- Learning (if there is a session for this entity)----------
+    enrollFace(e->id().str(), msr->timestamp(), faces_detected, entity_histogram);
 
 
     // ---------- Recognition ----------
 
     ed::ErrorContext errc2("Predicting face");
 
-    for (uint i=0 ; i<faces_detected.size() ; i++){
-
-        // perform recognition on each module
-        if (using_Eigen_ && trained_Eigen_){
-            models_[EIGEN]->predict(faces_detected[i].face_img,
-                                    faces_detected[i].predicted_label[EIGEN],
-                                    faces_detected[i].confidence[EIGEN]);
-        }
-
-        if (using_Fisher_ && trained_Fisher_){
-            models_[FISHER]->predict(faces_detected[i].face_img,
-                                     faces_detected[i].predicted_label[FISHER],
-                                     faces_detected[i].confidence[FISHER]);
-        }
+    // models can be updated or swapped by the (background) training, but not while predicting
+    boost::shared_lock<boost::shared_mutex> models_lock(models_mutex_);
 
-        if (using_LBPH_ && trained_LBPH_){
-            models_[LBPH]->predict(faces_detected[i].face_img,
-                                   faces_detected[i].predicted_label[LBPH],
-                                   faces_detected[i].confidence[LBPH]);
-        }
+    // perform recognition on each module, for all faces in parallel (on the shared thread pool, so no threads
+    // are created here)
+    ed::perception::parallelFor(faces_detected.size() * 4, PredictTask(*this, faces_detected, entity_histogram));
 
-        if (using_histogram_){
-            matchHistograms(entity_histogram,
-                            learned_histograms_,
-                            faces_detected[i].predicted_label[HIST],
-                            faces_detected[i].confidence[HIST]);
-        }
+    for (uint i=0 ; i<faces_detected.size() ; i++){
 
         // fill labels with the predicted name, in case there was a prediction
         faces_detected[i].predicted_name[EIGEN] = faces_detected[i].predicted_label[EIGEN] > -1 ?
@@ -395,6 +381,8 @@ void FaceRecognition::process(const ed::perception::WorkerInput& input, ed::perc
                              faces_detected[i].face_confidence_match);
     }
 
+    models_lock.unlock();
+
     // ----------------------- Assert results -----------------------
 
     // create group if it doesnt exist
@@ -468,6 +456,136 @@ void FaceRecognition::process(const ed::perception::WorkerInput& input, ed::perc
 // ----------------------------------------------------------------------------------------------------
 
 
+void FaceRecognition::predictFace(FaceInfo& face, int recognizer, cv::Mat& entity_histogram) const{
+
+    if (recognizer == EIGEN && using_Eigen_ && trained_Eigen_){
+        models_[EIGEN]->predict(face.face_img, face.predicted_label[EIGEN], face.confidence[EIGEN]);
+
+    }else if (recognizer == FISHER && using_Fisher_ && trained_Fisher_){
+        models_[FISHER]->predict(face.face_img, face.predicted_label[FISHER], face.confidence[FISHER]);
+
+    }else if (recognizer == LBPH && using_LBPH_ && trained_LBPH_){
+        // use the index for large galleries, unless it can not handle the face
+        if (lbph_index_.size() == 0 || !lbph_index_.predict(face.face_img, face.predicted_label[LBPH], face.confidence[LBPH]))
+            models_[LBPH]->predict(face.face_img, face.predicted_label[LBPH], face.confidence[LBPH]);
+
+    }else if (recognizer == HIST && using_histogram_){
+        matchHistograms(entity_histogram, learned_histograms_, face.predicted_label[HIST], face.confidence[HIST]);
+    }
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+EnrollmentSession* FaceRecognition::getEnrollmentSession(const std::string& entity_id, double timestamp) const{
+
+    EnrollmentSession* unbound = 0;
+
+    uint n_active = std::min(enrollment_sessions_.size(), (size_t)std::max(1, max_enrollment_sessions_));
+
+    for (uint i=0 ; i<n_active ; i++){
+        EnrollmentSession& session = enrollment_sessions_[i];
+
+        if (session.entity_id == entity_id)
+            return &session;
+
+        // the entity of the session is lost, so let the session continue with another one
+        if (!session.entity_id.empty() && timestamp - session.last_face_time > ENROLLMENT_TIMEOUT){
+            std::cout << "[" << module_name_ << "] " << "Lost entity " << session.entity_id << " while learning " << session.name << std::endl;
+            session.entity_id.clear();
+        }
+
+        if (!unbound && session.entity_id.empty())
+            unbound = &session;
+    }
+
+    if (unbound){
+        unbound->entity_id = entity_id;
+        std::cout << "[" << module_name_ << "] " << "Learning " << unbound->name << " from entity " << entity_id << std::endl;
+    }
+
+    return unbound;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+void FaceRecognition::enrollFace(const std::string& entity_id, double timestamp, std::vector<FaceInfo>& faces, cv::Mat& entity_histogram) const{
+
+    // without a face there is nothing to learn, and the entity should not take a pending session
+    if (faces.empty())
+        return;
+
+    boost::mutex::scoped_lock lock(enrollment_mutex_);
+
+    EnrollmentSession* session = getEnrollmentSession(entity_id, timestamp);
+    if (!session)
+        return;
+
+    session->last_face_time = timestamp;
+
+    ed::ErrorContext errc("Learning face in FaceRecognition");
+
+    int largest_face_idx = 0;
+    int biggest_area = 0;
+
+    // get biggest face available
+    for (uint i=0 ; i<faces.size() ; i++){
+        if (faces[i].features.width * faces[i].features.height > biggest_area){
+            biggest_area = faces[i].features.width * faces[i].features.height;
+            largest_face_idx = i;
+        }
+    }
+
+    // recognition uses the training set, so it can not be changed while predicting
+    boost::unique_lock<boost::shared_mutex> models_lock(models_mutex_);
+
+    // true when learning is complete
+    bool complete = learnFace(session->name, session->label, faces[largest_face_idx].face_img, entity_histogram, session->n_faces, images_, labels_, labels_info_);
+
+    models_lock.unlock();
+
+    if (complete){
+        bool from_action = session->from_action;
+        std::string name = session->name;
+
+        // remove the session, the next one in the queue (if any) becomes active
+        for (std::deque<EnrollmentSession>::iterator it = enrollment_sessions_.begin() ; it != enrollment_sessions_.end() ; ++it){
+            if (&(*it) == session){
+                enrollment_sessions_.erase(it);
+                break;
+            }
+        }
+
+        // update LBPH, and retrain Eigen and Fisher in the background
+        updateRecognizers();
+
+        if (from_action && as_ && as_->isActive()){
+            ed_perception::FaceLearningResult learning_result_;
+            learning_result_.result_info = "Learning complete";
+            as_->setSucceeded(learning_result_);
+        }
+
+        std::cout << "[" << module_name_ << "] " << "Learning of " << name << " complete!" << std::endl;
+
+    }else{
+        // update number of faces learned
+        session->n_faces++;
+
+        if (session->from_action && as_ && as_->isActive()){
+            ed_perception::FaceLearningFeedback learning_feedback_;
+            learning_feedback_.faces_learned = session->n_faces;
+            as_->publishFeedback(learning_feedback_);
+        }
+    }
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
 void FaceRecognition::getEntityHistogram(tue::Configuration config, cv::Mat& entity_histogram) const{
 
     std::string color;
@@ -524,7 +642,7 @@ bool FaceRecognition::learnFace(std::string person_name,
     std::map <int, std::vector<cv::Mat> >::iterator find_it;
 
     std::cout << "[" << module_name_ << "] " << "Learning face: " << person_name << ", with label " << person_label
-              << " (" << n_faces_current_ << "/" << max_faces_learn_ << ")" << std::endl;
+              << " (" << n_face << "/" << max_faces_learn_ << ")" << std::endl;
 
     // add face and name to the DB
     face_images.push_back(face);
@@ -544,32 +662,6 @@ bool FaceRecognition::learnFace(std::string person_name,
         learned_histograms_.insert(std::pair<int, std::vector<cv::Mat> >(person_label, temp_vec));
     }
 
-    if (save_learned_faces_){
-        // -------------------- save faces for re-learning --------------------
-
-        // create faces folder if it doesn't exist already
-        std::string local_save_dir = saved_faces_dir_ + person_name + "/";
-        boost::filesystem::path dir(local_save_dir);
-        if( !(boost::filesystem::exists(dir)))
-            boost::filesystem::create_directories(dir);
-
-        // save image
-        std::string file_name = person_name + "_" + ed::Entity::generateID().c_str();
-        cv::imwrite(local_save_dir + file_name + ".pgm", face);
-
-
-        // -------------------- update CSV file --------------------
-        std::stringstream path_on_disk;
-        path_on_disk << local_save_dir << file_name;
-
-        // Add path to cvs file
-        std::string cvs_file_name = saved_faces_dir_ + "face_models.cvs";
-        std::fstream myfile;
-        myfile.open (cvs_file_name.c_str(), std::fstream::in | std::fstream::out | std::fstream::app);
-        myfile << local_save_dir << file_name << ".pgm" << ";" << person_label << ";" << person_name << "\n";
-        myfile.close();
-    }
-
     // if the number os faces learned for this user is more than max_faces_learn_, then its done
     return n_face >= max_faces_learn_;
 }
@@ -584,35 +676,33 @@ void FaceRecognition::matchHistograms(cv::Mat& entity_histogram,
                                       double& color_match_confidence) const{
 
     std::map<int, std::vector<cv::Mat> >::const_iterator map_it;
-    std::vector<double> scores;
     double avg_score;
     double score;
 
+    const float* entity_hist = entity_histogram.ptr<float>(0);
+
     // iterate through all people learned
     for(map_it = learned_histograms.begin(); map_it != learned_histograms.end(); ++map_it){
+        const std::vector<cv::Mat>& person_histograms = map_it->second;
+
+        if (person_histograms.empty())
+            continue;
+
         avg_score = 0;
-        scores.clear();
 
-//        std::cout << "[" << module_name_ << "] " << "For " << labels_info_.at(map_it->first) << std::endl;
         // iterate through each histogram from this person
-        for(uint i=0 ; i< map_it->second.size() ; i++){
-            score = cv::compareHist(entity_histogram, map_it->second[i], CV_COMP_CORREL);
+        for(uint i=0 ; i< person_histograms.size() ; i++){
+            score = ed::perception::histogramCorrelation(entity_hist, person_histograms[i].ptr<float>(0), entity_histogram.cols);
 
             // sometimes the comprisson returns a negative score, not sure why but i dont like it
             if (score < 0)
                 score = 0;
 
-            scores.push_back(score);
-//            std::cout << "[" << module_name_ << "] " << "\t: " << scores[i] << std::endl;
+            avg_score += score;
         }
 
         // calculate average
-        for(uint i=0 ; i < scores.size() ; i++){
-            avg_score += scores[i];
-        }
-
-        avg_score /= scores.size();
-//        std::cout << "[" << module_name_ << "] " << "avg: " << avg_score << std::endl;
+        avg_score /= person_histograms.size();
 
         if (color_match_confidence < avg_score){
             color_match_confidence = avg_score;
@@ -696,23 +786,16 @@ void FaceRecognition::matchClassifications(std::vector<std::string> classificati
 bool FaceRecognition::srvStartLearning(const ed_perception::LearnPerson::Request& ros_req, ed_perception::LearnPerson::Response& ros_res){
     std::cout << "[" << module_name_ << "] " << "Service called, person name: " << ros_req.person_name << std::endl;
 
-    if (!learning_mode_){
-
-        std::cout << "[" << module_name_ << "] " << "Learning service, received new request." << std::endl;
+    boost::mutex::scoped_lock lock(enrollment_mutex_);
 
-        learning_name_ = ros_req.person_name;
-        n_faces_current_ = 0;
+    // the session is queued, and starts as soon as fewer than max_enrollment_sessions_ people are being learned
+    enrollment_sessions_.push_back(EnrollmentSession(ros_req.person_name, last_label_++, false));
 
-        learning_mode_ = true;
+    std::cout << "[" << module_name_ << "] " << "Learning service, queued " << ros_req.person_name << " (" << enrollment_sessions_.size() << " in queue)." << std::endl;
 
-//        ros_res.info = "Learning started";
-
-//        return true;
-    }else{
-        ros_res.info = "Learning already in progress! Please wait.";
+    ros_res.info = "Learning queued";
 
-        return false;
-    }
+    return true;
 }
 
 
@@ -723,19 +806,23 @@ void FaceRecognition::learning_as_goal(){
 
     std::cout << "[" << module_name_ << "] " << "Learning service, received new goal." << std::endl;
 
-    if (!learning_mode_){
-        n_faces_current_ = 0;
-        learning_mode_ = true;
-
-        // accept the new goal and get the name
-        learning_name_ = as_->acceptNewGoal()->person_name;;
+    boost::mutex::scoped_lock lock(enrollment_mutex_);
 
-        std::cout << "[" << module_name_ << "] " << "Learning person with name: " << learning_name_ << std::endl;
-    }else{
-        ed_perception::FaceLearningResult learning_result_;
-        learning_result_.result_info = "Learning already in progress! Cannot take another request.";
-        as_->setAborted(learning_result_);
+    // the action server handles a single goal at a time, so there can be only one session for it
+    for (uint i=0 ; i<enrollment_sessions_.size() ; i++){
+        if (enrollment_sessions_[i].from_action){
+            ed_perception::FaceLearningResult learning_result_;
+            learning_result_.result_info = "Learning already in progress! Cannot take another request.";
+            as_->setAborted(learning_result_);
+            return;
+        }
     }
+
+    // accept the new goal and get the name
+    std::string name = as_->acceptNewGoal()->person_name;
+    enrollment_sessions_.push_back(EnrollmentSession(name, last_label_++, true));
+
+    std::cout << "[" << module_name_ << "] " << "Learning person with name: " << name << " (" << enrollment_sessions_.size() << " in queue)." << std::endl;
 }
 
 
@@ -743,7 +830,17 @@ void FaceRecognition::learning_as_goal(){
 
 
 void FaceRecognition::learning_as_preempt(){
-    std::cout << "[" << module_name_ << "] " << "" << std::endl;
+    std::cout << "[" << module_name_ << "] " << "Learning preempted" << std::endl;
+
+    boost::mutex::scoped_lock lock(enrollment_mutex_);
+
+    // stop the session of the action, the faces learned so far are kept
+    for (std::deque<EnrollmentSession>::iterator it = enrollment_sessions_.begin() ; it != enrollment_sessions_.end() ; ++it){
+        if (it->from_action){
+            enrollment_sessions_.erase(it);
+            break;
+        }
+    }
 
     // set the action state to preempted
     as_->setPreempted();
@@ -917,6 +1014,8 @@ void FaceRecognition::trainRecognizers(std::vector<cv::Mat>& images, std::vector
         models[LBPH]->train(images, labels);
         std::cout << "[" << module_name_ << "] " << "LBPH Faces trained!" << std::endl;
         trained_LBPH_ = true;
+        n_images_LBPH_ = images.size();
+        updateLBPHIndex();
     }
 
     // train Fisher Faces
@@ -934,6 +1033,222 @@ void FaceRecognition::trainRecognizers(std::vector<cv::Mat>& images, std::vector
 // ----------------------------------------------------------------------------------------------------
 
 
+void FaceRecognition::updateLBPHIndex() const{
+
+    if (lbph_index_min_size_ < 0 || n_images_LBPH_ < (uint)lbph_index_min_size_){
+        lbph_index_.clear();
+        return;
+    }
+
+    lbph_index_.build(models_[LBPH]);
+
+    std::cout << "[" << module_name_ << "] " << "LBPH index built over " << lbph_index_.size() << " histograms." << std::endl;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+void FaceRecognition::updateRecognizers() const{
+
+    if (images_.empty())
+        return;
+
+    // LBPH supports updating, so only the images learned since the last update have to be added
+    if (using_LBPH_ && n_images_LBPH_ < images_.size()){
+        std::vector<cv::Mat> new_images(images_.begin() + n_images_LBPH_, images_.end());
+        std::vector<int> new_labels(labels_.begin() + n_images_LBPH_, labels_.end());
+
+        boost::unique_lock<boost::shared_mutex> lock(models_mutex_);
+
+        if (trained_LBPH_)
+            models_[LBPH]->update(new_images, new_labels);
+        else
+            models_[LBPH]->train(new_images, new_labels);
+
+        trained_LBPH_ = true;
+        n_images_LBPH_ = images_.size();
+        updateLBPHIndex();
+
+        std::cout << "[" << module_name_ << "] " << "LBPH Faces updated with " << new_images.size() << " images!" << std::endl;
+    }
+
+    // Eigen and Fisher Faces have to be retrained from scratch, which is done in the background. The gallery
+    // is saved by the same thread, once that is done.
+    if (using_Eigen_ || using_Fisher_ || save_learned_faces_)
+        startBackgroundTraining();
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+void FaceRecognition::checkBackgroundTraining() const{
+
+    {
+        boost::mutex::scoped_lock lock(training_mutex_);
+
+        if (training_running_ || !training_pending_)
+            return;
+    }
+
+    // starting training copies the training set
+    boost::mutex::scoped_lock enrollment_lock(enrollment_mutex_);
+    startBackgroundTraining();
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+void FaceRecognition::startBackgroundTraining(bool save_gallery) const{
+
+    boost::mutex::scoped_lock lock(training_mutex_);
+
+    if (training_running_){
+        training_pending_ = true;
+        return;
+    }
+
+    // the previous training is finished (or about to), so joining does not block
+    if (training_thread_.joinable())
+        training_thread_.join();
+
+    training_running_ = true;
+    training_pending_ = false;
+
+    // the thread gets its own copy of the training set, so learning can continue while training
+    training_thread_ = boost::thread(boost::bind(&FaceRecognition::trainInBackground, this, getGallery(), save_gallery));
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+void FaceRecognition::trainInBackground(FaceGallery gallery, bool save_gallery) const{
+
+    cv::Ptr<cv::FaceRecognizer> eigen_model;
+    cv::Ptr<cv::FaceRecognizer> fisher_model;
+
+    if (using_Eigen_ || using_Fisher_)
+        std::cout << "[" << module_name_ << "] " << "Training in background with " << gallery.images.size() << " images for " << gallery.names.size() << " different people." << std::endl;
+
+    // an exception would end the thread (and the process), so on failure the previous models are kept
+    try{
+        // train Eingen Faces
+        if (using_Eigen_){
+            eigen_model = cv::createEigenFaceRecognizer();
+            eigen_model->train(gallery.images, gallery.labels);
+        }
+
+        // train Fisher Faces
+        if (using_Fisher_){
+            if (gallery.names.size() > 1){
+                fisher_model = cv::createFisherFaceRecognizer();
+                fisher_model->train(gallery.images, gallery.labels);
+            }else
+                std::cout << "[" << module_name_ << "] " << "Could not train Fisher Faces, needs more than 1 class!" << std::endl;
+        }
+    }catch (const std::exception& e){
+        std::cout << "[" << module_name_ << "] " << "Training failed, keeping the previous models: " << e.what() << std::endl;
+
+        eigen_model.release();
+        fisher_model.release();
+    }
+
+    // swap in the new models, recognition used the previous ones until now
+    {
+        boost::unique_lock<boost::shared_mutex> lock(models_mutex_);
+
+        if (!eigen_model.empty()){
+            models_[EIGEN] = eigen_model;
+            trained_Eigen_ = true;
+            std::cout << "[" << module_name_ << "] " << "Eigen Faces trained!" << std::endl;
+        }
+
+        if (!fisher_model.empty()){
+            models_[FISHER] = fisher_model;
+            trained_Fisher_ = true;
+            std::cout << "[" << module_name_ << "] " << "Fisher Faces trained!" << std::endl;
+        }
+    }
+
+    // saved here, so recognition does not wait for the disk. A gallery learned meanwhile is saved by the next run
+    if (save_gallery && save_learned_faces_ && !saveGallery(gallery, saved_faces_dir_ + "face_gallery.bin"))
+        std::cout << "[" << module_name_ << "] " << "Could not save gallery in " << saved_faces_dir_ << std::endl;
+
+    boost::mutex::scoped_lock lock(training_mutex_);
+    training_running_ = false;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+bool FaceRecognition::loadGallery(const std::string& filename){
+
+    FaceGallery gallery;
+    if (!gallery.readFromFile(filename))
+        return false;
+
+    images_ = gallery.images;
+    labels_ = gallery.labels;
+    labels_info_ = gallery.names;
+    learned_histograms_ = gallery.histograms;
+    last_label_ = labels_info_.empty() ? 0 : labels_info_.rbegin()->first + 1;
+
+    if (images_.empty())
+        return true;
+
+    // LBPH training only computes a histogram per face, so it is done right away
+    if (using_LBPH_){
+        models_[LBPH]->train(images_, labels_);
+        trained_LBPH_ = true;
+        n_images_LBPH_ = images_.size();
+        updateLBPHIndex();
+    }
+
+    // Eigen and Fisher Faces are trained in the background, until then only LBPH recognizes faces. The gallery
+    // does not have to be saved again.
+    if (using_Eigen_ || using_Fisher_)
+        startBackgroundTraining(false);
+
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+FaceGallery FaceRecognition::getGallery() const{
+
+    FaceGallery gallery;
+    gallery.images = images_;
+    gallery.labels = labels_;
+    gallery.names = labels_info_;
+    gallery.histograms = learned_histograms_;
+
+    return gallery;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
+bool FaceRecognition::saveGallery(const FaceGallery& gallery, const std::string& filename) const{
+
+    if (!gallery.writeToFile(filename))
+        return false;
+
+    std::cout << "[" << module_name_ << "] " << "Saved gallery with " << gallery.images.size() << " images to " << filename << std::endl;
+
+    return true;
+}
+
+
+// ----------------------------------------------------------------------------------------------------
+
+
 void FaceRecognition::readCSV( const std::string& filename,
                                std::vector<cv::Mat>& images,
                                std::vector<int>& labels,
@@ -1009,8 +1324,8 @@ bool FaceRecognition::alignFace(cv::Mat origImg, cv::Rect faceLoc, int targetSiz
     cv::Point leftEye;
     cv::Point rightEye;
     cv::Point refOrigin;
-    cv::Point topCorner;
-    cv::Rect cropArea;
+    cv::Mat alignMat;
+    cv::Mat faceColor;
     int bestEyeLeft = 0;
     int bestEyeRight = 0;
     int horizOffsetEye;
@@ -1026,9 +1341,16 @@ bool FaceRecognition::alignFace(cv::Mat origImg, cv::Rect faceLoc, int targetSiz
     cvtColor(origImg(faceLoc), faceDetectGray, CV_BGR2GRAY);
     cv::equalizeHist(faceDetectGray, faceDetectGray);
 
-    // detect eyes
-    //leftEyeDetector_.detectMultiScale(faceDetectGray, leftEyeLoc, 1.1, 1, 0 | CV_HAAR_SCALE_IMAGE);
-    //rightEyeDetector_.detectMultiScale(faceDetectGray, rightEyeLoc, 1.1, 1, 0 | CV_HAAR_SCALE_IMAGE);
+    // detect eyes, if eye cascades are configured
+    if (!cascade_left_eye_path_.empty() && !cascade_right_eye_path_.empty()){
+        cv::CascadeClassifier* leftEyeDetector = ed::perception::CascadeRegistry::get(cascade_left_eye_path_);
+        cv::CascadeClassifier* rightEyeDetector = ed::perception::CascadeRegistry::get(cascade_right_eye_path_);
+
+        if (leftEyeDetector && rightEyeDetector){
+            leftEyeDetector->detectMultiScale(faceDetectGray, leftEyeLoc, 1.1, 1, 0 | CV_HAAR_SCALE_IMAGE);
+            rightEyeDetector->detectMultiScale(faceDetectGray, rightEyeLoc, 1.1, 1, 0 | CV_HAAR_SCALE_IMAGE);
+        }
+    }
 
     // find the first detected eye that is on the correct side of the face
     for (uint i = 0; i < leftEyeLoc.size(); i++){
@@ -1071,13 +1393,6 @@ bool FaceRecognition::alignFace(cv::Mat origImg, cv::Rect faceLoc, int targetSiz
             return false;
         }
 
-        // copy original color image to align it
-        origImg.copyTo(faceImg);
-
-        // draw circles on the eyes
-//        circle(faceImg, leftEye + refOrigin, 2, cv::Scalar(0, 255, 0), 1);
-//        circle(faceImg, rightEye + refOrigin, 2, cv::Scalar(0, 0, 255), 1);
-
         // determine the horizontal and vertical offeset for the left eye
         horizOffsetEye = floor(horizOffset * targetSize);
         vertOffsetEye = floor(vertOffset * targetSize);
@@ -1086,23 +1401,17 @@ bool FaceRecognition::alignFace(cv::Mat origImg, cv::Rect faceLoc, int targetSiz
         //	the one defined by the offsets
         scale = (targetSize - 2 * horizOffsetEye) / (float) dist;
 
-        //rotate and resize the full image
-        rotateFace(faceImg, faceImg, leftEye + refOrigin, rightEye + refOrigin, leftEye + refOrigin);
-        resize(faceImg, faceImg, cv::Size(), scale, scale, cv::INTER_NEAREST);
-
-        // top corner is the position of the left eye - offsets
-        topCorner = cv::Point((leftEye.x + refOrigin.x) * scale, (leftEye.y + refOrigin.y) * scale)
-                 - cv::Point (horizOffsetEye, vertOffsetEye);
-
-        cropArea = cv::Rect(clipInt(topCorner.x, 0 , faceImg.cols - targetSize),
-                        clipInt(topCorner.y, 0 , faceImg.rows - targetSize),
-                        targetSize, targetSize);
+        // rotate around the left eye so the eyes are level, scale, and move the left eye to its offsets. Composed
+        // into a single transform, so only the pixels of the target image are computed
+        alignMat = cv::getRotationMatrix2D(leftEye + refOrigin, getEyeAngle(leftEye, rightEye), scale);
+        alignMat.at<double>(0, 2) += horizOffsetEye - (leftEye.x + refOrigin.x);
+        alignMat.at<double>(1, 2) += vertOffsetEye - (leftEye.y + refOrigin.y);
 
-        if (topCorner.x > faceImg.cols - targetSize || topCorner.y > faceImg.rows - targetSize)
-            std::cout << "[" << module_name_ << "] " << " Top Corner had to be clipped, face ROI was too small" << std::endl;
+        cv::warpAffine(origImg, faceColor, alignMat, cv::Size(targetSize, targetSize));
 
-        // crop the aligned image
-        faceImg(cropArea).copyTo(faceImg);
+        // same grayscale, equalized output as when the eyes are not found
+        cvtColor(faceColor, faceImg, CV_BGR2GRAY);
+        cv::equalizeHist(faceImg, faceImg);
 
         // eyes were corcv::Rectly detected
         faceAligned = true;
@@ -1155,10 +1464,9 @@ int FaceRecognition::euclidDistance(cv::Point p1, cv::Point p2) const{
 
 // ----------------------------------------------------------------------------------------------------
 
-void FaceRecognition::rotateFace(cv::Mat faceImg, cv::Mat& rotatedImg, cv::Point leftEye, cv::Point rightEye, cv::Point center) const{
+double FaceRecognition::getEyeAngle(cv::Point leftEye, cv::Point rightEye) const{
     double mod1, mod2, innerp, angle;
     cv::Point p3 (rightEye.x, leftEye.y);
-    cv::Mat rotMat;
 
     // module of the line between right eye and left eye
     mod1 = sqrt(pow(rightEye.y - leftEye.y, 2) + pow(rightEye.x - leftEye.x, 2));
@@ -1173,9 +1481,7 @@ void FaceRecognition::rotateFace(cv::Mat faceImg, cv::Mat& rotatedImg, cv::Point
     if (leftEye.y > rightEye.y)
         angle *= -1;
 
-    // get rotation cv::Matrix and apply it to the image
-    rotMat = cv::getRotationMatrix2D(center, angle, 1.0);
-    cv::warpAffine(faceImg, rotatedImg, rotMat, faceImg.size());
+    return angle;
 }
 
 ED_REGISTER_PERCEPTION_MODULE(FaceRecognition)
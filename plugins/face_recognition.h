@@ -26,7 +26,13 @@
 #include <ros/ros.h>
 #include <actionlib/server/simple_action_server.h>
 
+#include <boost/thread.hpp>
+
+#include <deque>
+
 #include "color_matcher/color_matcher.h"
+#include "lbph_index.h"
+#include "face_gallery.h"
 
 class FaceRecognition : public ed::perception::Module
 {
@@ -85,6 +91,21 @@ struct FaceInfo
     }
 };
 
+// A person being learned. The session is bound to the first entity it learns a face from, and only learns
+// faces from that entity afterwards, so several people can be learned at the same time.
+struct EnrollmentSession
+{
+    std::string name;       // name of the person
+    int label;              // label assigned to the person
+    uint n_faces;           // number of faces learned so far
+    std::string entity_id;  // entity the session is bound to, empty if not bound yet
+    double last_face_time;  // timestamp of the last face learned from the entity
+    bool from_action;       // true if requested through the action server, which gets feedback and the result
+
+    EnrollmentSession(const std::string& name_, int label_, bool from_action_)
+        : name(name_), label(label_), n_faces(0), last_face_time(0), from_action(from_action_) {}
+};
+
 /*
  * ###########################################
  *  				PRIVATE
@@ -99,7 +120,6 @@ private:
     bool debug_mode_;               // signal if debug mode is active, to enable output communication
     std::string module_name_;       // module name that shows up in the output
     std::string module_path_;       // module name that shows up in the output
-    mutable bool learning_mode_;    // true if face is being learned, false for normal recognition mode
     std::string saved_faces_dir_;    // directory where to save the faces learned, for later re-learning
     bool save_learned_faces_;        // wheter to save the faces learned or not
 
@@ -107,6 +127,8 @@ private:
     int face_target_size_;      // size of the image after alignement
     float face_vert_offset_;    // vertical offeset from the left eye to the top margin of the image
     float face_horiz_offset_;   // horizontal offeset from the left eye to the left margin of the image
+    std::string cascade_left_eye_path_;     // haar cascade used to detect the left eye (see CascadeRegistry)
+    std::string cascade_right_eye_path_;    // haar cascade used to detect the right eye (see CascadeRegistry)
 
     float eigen_treshold_;      // treshold for a trustworthy classification with Eigen Faces
     float fisher_treshold_;     // treshold for a trustworthy classification with Fisher Faces
@@ -122,6 +144,18 @@ private:
 
     // Face recognizers
     mutable std::vector<cv::Ptr<cv::FaceRecognizer> > models_;      // vector of models for the FaceRecognizers
+    mutable boost::shared_mutex models_mutex_;  // shared for prediction, exclusive for updating / swapping models_
+    mutable uint n_images_LBPH_;                // number of images_ already incorporated in the LBPH model
+    mutable LBPHIndex lbph_index_;              // nearest neighbour index over the LBPH histograms, empty if not used
+    int lbph_index_min_size_;                   // minimum number of LBPH images for which lbph_index_ is used (-1 to disable)
+    int lbph_index_candidates_;                 // number of index candidates that are compared exactly
+    int lbph_index_max_checks_;                 // maximum number of histograms compared while searching the index (0 for no limit)
+
+    // Background training of Eigen and Fisher Faces
+    mutable boost::thread training_thread_;
+    mutable boost::mutex training_mutex_;
+    mutable bool training_running_;     // true while training_thread_ is training
+    mutable bool training_pending_;     // true if images were added while training, so training has to be restarted
 
     bool using_Eigen_;          // is Eingen Faces recognition enabled
     bool using_Fisher_;         // is Fisher Faces recognition enabled
@@ -137,10 +171,13 @@ private:
     // learning service
     mutable ros::CallbackQueue cb_queue_;   // service queue
     ros::ServiceServer srv_learn_face;      // service to learn new face
-    std::string learning_name_;             // name to be used in the learning process
-    mutable uint n_faces_current_;          // number of faces learned for the last request
     int max_faces_learn_;                  // total number of faces to be learned for each model
 
+    // enrollment
+    mutable std::deque<EnrollmentSession> enrollment_sessions_;    // requested sessions, the first max_enrollment_sessions_ are active
+    mutable boost::mutex enrollment_mutex_;     // protects the sessions and the training set (images_, labels_, ...)
+    int max_enrollment_sessions_;               // maximum number of people learned at the same time, others are queued
+
 
     actionlib::SimpleActionServer<ed_perception::FaceLearningAction> *as_;
 
@@ -154,6 +191,18 @@ private:
                   std::map<int, std::string>& labelsInfo,
                   char separator = ';');
 
+    // loads the faces, names and histograms from a gallery written by saveGallery, and trains the recognizers
+    bool loadGallery(const std::string& filename);
+
+    // copy of the faces, names and histograms learned so far. enrollment_mutex_ must be locked (if learning)
+    FaceGallery getGallery() const;
+
+    // saves the faces, names and histograms to a binary gallery file
+    bool saveGallery(const FaceGallery& gallery, const std::string& filename) const;
+
+    // restarts background training if faces were learned while it was running
+    void checkBackgroundTraining() const;
+
     // reads the config of the entity to determine if a face was found
     bool isFaceFound(tue::Configuration config) const;
 
@@ -169,8 +218,8 @@ private:
     // calculate euclidean distance between two points
     int euclidDistance(cv::Point p1, cv::Point p2) const;
 
-    // rotate a face according to the position of the eyes
-    void rotateFace(cv::Mat faceImg, cv::Mat& rotatedImg, cv::Point leftEye, cv::Point rightEye, cv::Point center) const;
+    // angle (in degrees) over which a face has to be rotated to level the eyes
+    double getEyeAngle(cv::Point leftEye, cv::Point rightEye) const;
 
     // match the results from the recogniton into a single result
     void matchClassifications(std::vector<std::string> classifications,
@@ -188,6 +237,30 @@ private:
     // function called when service is requested
     bool srvStartLearning(const ed_perception::LearnPerson::Request& ros_req, ed_perception::LearnPerson::Response& ros_res);
 
+    // returns the active session bound to the entity, or binds the first unbound active session to it. Sessions
+    // of which the entity was not seen for a while are unbound first. Returns 0 if there is no session for the
+    // entity. enrollment_mutex_ must be locked
+    EnrollmentSession* getEnrollmentSession(const std::string& entity_id, double timestamp) const;
+
+    // learns the largest face for the enrollment session of the entity, if there is one
+    void enrollFace(const std::string& entity_id, double timestamp, std::vector<FaceInfo>& faces, cv::Mat& entity_histogram) const;
+
+    // predicts the label of a face with one of the recognizers (EIGEN, FISHER, LBPH or HIST)
+    void predictFace(FaceInfo& face, int recognizer, cv::Mat& entity_histogram) const;
+
+    struct PredictTask
+    {
+        PredictTask(const FaceRecognition& module_, std::vector<FaceInfo>& faces_, cv::Mat& entity_histogram_)
+            : module(module_), faces(faces_), entity_histogram(entity_histogram_) {}
+
+        // prediction i is of face i / 4 with recognizer i % 4
+        void operator()(unsigned int i) const { module.predictFace(faces[i / 4], i % 4, entity_histogram); }
+
+        const FaceRecognition& module;
+        std::vector<FaceInfo>& faces;
+        cv::Mat& entity_histogram;
+    };
+
     // learns a face
     bool learnFace(std::string person_name,
                    int person_label,
@@ -201,6 +274,20 @@ private:
     // trains the opencv FaceRecognizers
     void trainRecognizers(std::vector<cv::Mat>& images, std::vector<int>& labels, std::vector<cv::Ptr<cv::FaceRecognizer> >& models) const;
 
+    // (re)builds lbph_index_ from the LBPH model if the gallery is large enough. models_mutex_ must be locked exclusively
+    void updateLBPHIndex() const;
+
+    // adds the newly learned images to the LBPH model and starts retraining Eigen and Fisher Faces and saving the
+    // gallery in the background
+    void updateRecognizers() const;
+
+    // starts trainInBackground on a copy of the current training set, or marks training as pending if it is already running
+    // (restarts always save the gallery, they are caused by learning)
+    void startBackgroundTraining(bool save_gallery = true) const;
+
+    // trains new Eigen and Fisher models and swaps them with the ones in models_ when done, then saves the gallery
+    void trainInBackground(FaceGallery gallery, bool save_gallery) const;
+
     // construct an histogram from the entities colors present in the config
     void getEntityHistogram(tue::Configuration config, cv::Mat& entity_histogram) const;
 
@@ -0,0 +1,268 @@
+#include "histogram_distance.h"
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+
+#if defined(__AVX__)
+#include <immintrin.h>
+#define ED_PERCEPTION_HISTOGRAM_SIMD
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define ED_PERCEPTION_HISTOGRAM_SIMD
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define ED_PERCEPTION_HISTOGRAM_SIMD
+#endif
+
+namespace
+{
+
+// Number of bins that are summed in float before the sum is added to the double total
+const int BLOCK_SIZE = 256;
+
+#if defined(__AVX__)
+
+typedef __m256 vfloat;
+const int VLEN = 8;
+
+inline vfloat vload(const float* p) { return _mm256_loadu_ps(p); }
+inline vfloat vzero() { return _mm256_setzero_ps(); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm256_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm256_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm256_mul_ps(a, b); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm256_min_ps(a, b); }
+
+// a / b where b != 0, and 0 where b == 0
+inline vfloat vdivNonZero(vfloat a, vfloat b)
+{
+    return _mm256_and_ps(_mm256_cmp_ps(b, _mm256_setzero_ps(), _CMP_NEQ_UQ), _mm256_div_ps(a, b));
+}
+
+inline float vsum(vfloat v)
+{
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#elif defined(__SSE2__)
+
+typedef __m128 vfloat;
+const int VLEN = 4;
+
+inline vfloat vload(const float* p) { return _mm_loadu_ps(p); }
+inline vfloat vzero() { return _mm_setzero_ps(); }
+inline vfloat vadd(vfloat a, vfloat b) { return _mm_add_ps(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return _mm_sub_ps(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return _mm_mul_ps(a, b); }
+inline vfloat vmin(vfloat a, vfloat b) { return _mm_min_ps(a, b); }
+
+inline vfloat vdivNonZero(vfloat a, vfloat b)
+{
+    return _mm_and_ps(_mm_cmpneq_ps(b, _mm_setzero_ps()), _mm_div_ps(a, b));
+}
+
+inline float vsum(vfloat v)
+{
+    __m128 s = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+
+typedef float32x4_t vfloat;
+const int VLEN = 4;
+
+inline vfloat vload(const float* p) { return vld1q_f32(p); }
+inline vfloat vzero() { return vdupq_n_f32(0); }
+inline vfloat vadd(vfloat a, vfloat b) { return vaddq_f32(a, b); }
+inline vfloat vsub(vfloat a, vfloat b) { return vsubq_f32(a, b); }
+inline vfloat vmul(vfloat a, vfloat b) { return vmulq_f32(a, b); }
+inline vfloat vmin(vfloat a, vfloat b) { return vminq_f32(a, b); }
+
+inline vfloat vdivNonZero(vfloat a, vfloat b)
+{
+    uint32x4_t non_zero = vmvnq_u32(vceqq_f32(b, vdupq_n_f32(0)));
+    return vreinterpretq_f32_u32(vandq_u32(non_zero, vreinterpretq_u32_f32(vdivq_f32(a, b))));
+}
+
+inline float vsum(vfloat v) { return vaddvq_f32(v); }
+
+#endif
+
+// ----------------------------------------------------------------------------------------------------
+
+struct ChiSquareTerm
+{
+#ifdef ED_PERCEPTION_HISTOGRAM_SIMD
+    vfloat operator()(vfloat a, vfloat b) const { vfloat d = vsub(a, b); return vdivNonZero(vmul(d, d), a); }
+#endif
+    double operator()(double a, double b) const { return a != 0 ? (a - b) * (a - b) / a : 0; }
+};
+
+struct SymmetricChiSquareTerm
+{
+#ifdef ED_PERCEPTION_HISTOGRAM_SIMD
+    vfloat operator()(vfloat a, vfloat b) const { vfloat d = vsub(a, b); return vdivNonZero(vmul(d, d), vadd(a, b)); }
+#endif
+    double operator()(double a, double b) const { return a + b != 0 ? (a - b) * (a - b) / (a + b) : 0; }
+};
+
+struct IntersectionTerm
+{
+#ifdef ED_PERCEPTION_HISTOGRAM_SIMD
+    vfloat operator()(vfloat a, vfloat b) const { return vmin(a, b); }
+#endif
+    double operator()(double a, double b) const { return std::min(a, b); }
+};
+
+// Sum of term(a[i], b[i]) over all bins
+template<typename T>
+double sumTerms(const float* a, const float* b, int n, const T& term)
+{
+    double sum = 0;
+    int i = 0;
+
+#ifdef ED_PERCEPTION_HISTOGRAM_SIMD
+    for(int block_start = 0; block_start + VLEN <= n; block_start = i)
+    {
+        int block_end = std::min(n, block_start + BLOCK_SIZE);
+
+        vfloat acc = vzero();
+        for(i = block_start; i + VLEN <= block_end; i += VLEN)
+            acc = vadd(acc, term(vload(a + i), vload(b + i)));
+
+        sum += vsum(acc);
+    }
+#endif
+
+    for(; i < n; ++i)
+        sum += term(a[i], b[i]);
+
+    return sum;
+}
+
+template<double (*F)(const float*, const float*, int)>
+void compareMany(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores)
+{
+    for(int i = 0; i < count; ++i)
+    {
+        const float* h = histograms + (indices ? (size_t)indices[i] : (size_t)i) * step;
+        scores[i] = F(h, query, n);
+    }
+}
+
+}
+
+namespace ed
+{
+namespace perception
+{
+
+// ----------------------------------------------------------------------------------------------------
+
+double chiSquareDistance(const float* a, const float* b, int n)
+{
+    return sumTerms(a, b, n, ChiSquareTerm());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double symmetricChiSquareDistance(const float* a, const float* b, int n)
+{
+    return sumTerms(a, b, n, SymmetricChiSquareTerm());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double histogramIntersection(const float* a, const float* b, int n)
+{
+    return sumTerms(a, b, n, IntersectionTerm());
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+double histogramCorrelation(const float* a, const float* b, int n)
+{
+    if (n <= 0)
+        return 1;
+
+    double s1 = 0, s2 = 0, s11 = 0, s22 = 0, s12 = 0;
+    int i = 0;
+
+#ifdef ED_PERCEPTION_HISTOGRAM_SIMD
+    for(int block_start = 0; block_start + VLEN <= n; block_start = i)
+    {
+        int block_end = std::min(n, block_start + BLOCK_SIZE);
+
+        vfloat acc1 = vzero(), acc2 = vzero(), acc11 = vzero(), acc22 = vzero(), acc12 = vzero();
+        for(i = block_start; i + VLEN <= block_end; i += VLEN)
+        {
+            vfloat va = vload(a + i);
+            vfloat vb = vload(b + i);
+            acc1 = vadd(acc1, va);
+            acc2 = vadd(acc2, vb);
+            acc11 = vadd(acc11, vmul(va, va));
+            acc22 = vadd(acc22, vmul(vb, vb));
+            acc12 = vadd(acc12, vmul(va, vb));
+        }
+
+        s1 += vsum(acc1);
+        s2 += vsum(acc2);
+        s11 += vsum(acc11);
+        s22 += vsum(acc22);
+        s12 += vsum(acc12);
+    }
+#endif
+
+    for(; i < n; ++i)
+    {
+        double va = a[i];
+        double vb = b[i];
+        s1 += va;
+        s2 += vb;
+        s11 += va * va;
+        s22 += vb * vb;
+        s12 += va * vb;
+    }
+
+    double scale = 1.0 / n;
+    double num = s12 - s1 * s2 * scale;
+    double denom2 = (s11 - s1 * s1 * scale) * (s22 - s2 * s2 * scale);
+
+    return std::abs(denom2) > DBL_EPSILON ? num / std::sqrt(denom2) : 1.0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void chiSquareDistances(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores)
+{
+    compareMany<chiSquareDistance>(query, histograms, step, indices, count, n, scores);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void symmetricChiSquareDistances(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores)
+{
+    compareMany<symmetricChiSquareDistance>(query, histograms, step, indices, count, n, scores);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void histogramCorrelations(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores)
+{
+    compareMany<histogramCorrelation>(query, histograms, step, indices, count, n, scores);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void histogramIntersections(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores)
+{
+    compareMany<histogramIntersection>(query, histograms, step, indices, count, n, scores);
+}
+
+}
+}
@@ -0,0 +1,41 @@
+#ifndef ED_PERCEPTION_HISTOGRAM_DISTANCE_H_
+#define ED_PERCEPTION_HISTOGRAM_DISTANCE_H_
+
+#include <cstddef>
+
+namespace ed
+{
+namespace perception
+{
+
+// Comparison of float histograms of length n. The kernels use AVX, SSE or NEON (AArch64) if the compiler
+// targets them, with a scalar fallback. Terms are summed in float per block of bins and the block sums in
+// double, so results match cv::compareHist up to float rounding.
+
+// Chi-square distance as used by CV_COMP_CHISQR and LBPH: sum((a - b)^2 / a) over the bins where a != 0
+double chiSquareDistance(const float* a, const float* b, int n);
+
+// Symmetric chi-square distance: sum((a - b)^2 / (a + b)) over the bins where a + b != 0
+double symmetricChiSquareDistance(const float* a, const float* b, int n);
+
+// Correlation, as CV_COMP_CORREL (1 if either of the histograms is constant)
+double histogramCorrelation(const float* a, const float* b, int n);
+
+// Intersection, as CV_COMP_INTERSECT: sum(min(a, b))
+double histogramIntersection(const float* a, const float* b, int n);
+
+// One-vs-many versions of the above. Compares 'query' with 'count' histograms, of which histogram i starts at
+// histograms + indices[i] * step (or histograms + i * step if indices is 0), and writes the result to scores[i].
+// Histograms are passed as the first argument (a) and the query as the second (b).
+void chiSquareDistances(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores);
+
+void symmetricChiSquareDistances(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores);
+
+void histogramCorrelations(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores);
+
+void histogramIntersections(const float* query, const float* histograms, size_t step, const int* indices, int count, int n, double* scores);
+
+}
+}
+
+#endif
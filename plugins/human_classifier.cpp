@@ -5,10 +5,146 @@
 */
 
 #include "human_classifier.h"
+#include "cascade_registry.h"
+#include "parallel_for.h"
 #include <boost/filesystem.hpp>
+#include <boost/thread/tss.hpp>
+
+#include <climits>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include <ed/error_context.h>
 
+namespace
+{
+
+// range of depths (in meters) the template bank is built for, templates of objects outside it get the closest scale
+const float kBankMinDepth = 0.5;
+const float kBankMaxDepth = 10.0;
+
+// Scratch buffers of the template matching, one set per thread so the buffers can be reused between calls
+struct MatchBuffers {
+    std::vector<int> pos_x;     /*!< X positions of the transformed template points */
+    std::vector<int> pos_y;     /*!< Y positions of the transformed template points */
+    std::vector<uint> stamps;   /*!< epoch in which each map position was last tested */
+    uint epoch;                 /*!< current epoch */
+
+    cv::Mat contour_input;      /*!< copy of the mask for findContours, which modifies its input */
+    cv::Mat contour_line;       /*!< outline of the contour, black on white, with border */
+    cv::Mat map_dt;             /*!< distance transform of the outline */
+    cv::Mat grad_x;             /*!< sobel gradient of the distance transform in X */
+    cv::Mat grad_y;             /*!< sobel gradient of the distance transform in Y */
+
+    MatchBuffers() : epoch(0) {}
+
+    // starts a new epoch for a map of the given size, so all its positions are untested
+    uint NextEpoch(size_t map_size) {
+        if (stamps.size() < map_size)
+            stamps.resize(map_size, 0);
+
+        if (++epoch == 0) {
+            // wrapped around, forget all old stamps
+            std::fill(stamps.begin(), stamps.end(), 0);
+            epoch = 1;
+        }
+
+        return epoch;
+    }
+};
+
+boost::thread_specific_ptr<MatchBuffers> thread_match_buffers;
+
+MatchBuffers& getMatchBuffers() {
+    if (!thread_match_buffers.get())
+        thread_match_buffers.reset(new MatchBuffers());
+
+    return *thread_match_buffers;
+}
+
+// result of matching one template
+struct TemplateMatch {
+    bool valid;
+    cv::Point3i pos;
+    cv::Point3i init_pos;
+    float error;
+    float variance;
+    float deviation;
+
+    TemplateMatch() : valid(false), error(0), variance(0), deviation(0) {}
+};
+
+// matches template i with the DT map, to run the templates in parallel
+struct MatchTask {
+    MatchTask(const HumanClassifier& classifier_, const cv::Mat& mask_, cv::Mat& map_dt_, const cv::Mat& grad_x_,
+              const cv::Mat& grad_y_, const std::vector<TemplateView>& templates_, std::vector<TemplateMatch>& matches_)
+        : classifier(classifier_), mask(mask_), map_dt(map_dt_), grad_x(grad_x_), grad_y(grad_y_), templates(templates_),
+          matches(matches_) {}
+
+    void operator()(unsigned int i) const {
+        TemplateMatch& m = matches[i];
+        m.valid = classifier.PerfectMatch(mask, map_dt, grad_x, grad_y, templates[i], m.pos, m.init_pos, m.error, m.variance, m.deviation);
+    }
+
+    const HumanClassifier& classifier;
+    const cv::Mat& mask;
+    cv::Mat& map_dt;
+    const cv::Mat& grad_x;
+    const cv::Mat& grad_y;
+    const std::vector<TemplateView>& templates;
+    std::vector<TemplateMatch>& matches;
+};
+
+#ifdef __SSE2__
+// floor(v) clipped to [0, max]. v is truncated to an integer, and corrected by one where that rounded up.
+inline __m128i FloorClip(__m128 v, __m128 max) {
+    __m128 t = _mm_cvtepi32_ps(_mm_cvttps_epi32(v));
+    t = _mm_sub_ps(t, _mm_and_ps(_mm_cmpgt_ps(t, v), _mm_set1_ps(1.0f)));
+    return _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(t, _mm_setzero_ps()), max));
+}
+#endif
+
+// map positions of the template points, rotated by the angle of the anchor and translated to its position, clipped
+// to a map of the given size. Uses the same single precision operations in the same order as the scalar version,
+// so both give the same positions.
+void TransformTemplate(const TemplateView& template_pts, const cv::Vec3f& anchor, float anchor_sin, float anchor_cos,
+                       int cols, int rows, int* pos_x, int* pos_y) {
+    uint n = template_pts.size();
+    uint i = 0;
+
+#ifdef __SSE2__
+    __m128 ax = _mm_set1_ps(anchor[0]);
+    __m128 ay = _mm_set1_ps(anchor[1]);
+    __m128 vsin = _mm_set1_ps(anchor_sin);
+    __m128 vcos = _mm_set1_ps(anchor_cos);
+    __m128 max_x = _mm_set1_ps(cols - 1);
+    __m128 max_y = _mm_set1_ps(rows - 1);
+
+    for (; i + 4 <= n; i += 4) {
+        __m128 x = _mm_loadu_ps(&template_pts.x[i]);
+        __m128 y = _mm_loadu_ps(&template_pts.y[i]);
+
+        __m128 fx = _mm_add_ps(ax, _mm_sub_ps(_mm_mul_ps(x, vcos), _mm_mul_ps(y, vsin)));
+        __m128 fy = _mm_add_ps(ay, _mm_add_ps(_mm_mul_ps(x, vsin), _mm_mul_ps(y, vcos)));
+
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pos_x + i), FloorClip(fx, max_x));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pos_y + i), FloorClip(fy, max_y));
+    }
+#endif
+
+    for (; i < n; i++) {
+        float fx = anchor[0] + (template_pts.x[i] * anchor_cos - template_pts.y[i] * anchor_sin);
+        float fy = anchor[1] + (template_pts.x[i] * anchor_sin + template_pts.y[i] * anchor_cos);
+
+        pos_x[i] = std::min(std::max((int)floor(fx), 0), cols - 1);
+        pos_y[i] = std::min(std::max((int)floor(fy), 0), rows - 1);
+    }
+}
+
+}
+
 HumanClassifier::HumanClassifier(const std::string& module_name) {
     module_name_ = module_name;
 }
@@ -21,10 +157,12 @@ HumanClassifier::~HumanClassifier()
 bool HumanClassifier::Classify(const cv::Mat& depth_img,
                                const cv::Mat& color_img,
                                const cv::Mat& depth_mask,
+                               const cv::Point& mask_offset,
                                float& avg_depth,
                                float& template_match_error,
                                float& template_match_deviation,
-                               std::string& template_stance) const {
+                               std::string& template_stance,
+                               MatchHint& hint) const {
 
     ed::ErrorContext errc("Processing entity in HumanClassifier, Classify(...)");
 
@@ -38,7 +176,7 @@ bool HumanClassifier::Classify(const cv::Mat& depth_img,
     bool faceDetected = false;
 
     // try the template matching
-    if (TemplateClassification(depth_img, depth_mask, avg_depth, match_pos, match_init_pos, match_error, match_variance, template_match_deviation, template_type, measurement)){
+    if (TemplateClassification(depth_img, depth_mask, mask_offset, avg_depth, match_pos, match_init_pos, match_error, match_variance, template_match_deviation, template_type, measurement, hint)){
         if (template_type == FaceFront){
             template_stance = "front";
         }
@@ -75,6 +213,7 @@ bool HumanClassifier::Classify(const cv::Mat& depth_img,
 
 bool HumanClassifier::TemplateClassification(const cv::Mat& depth_image,
                                              const cv::Mat& mask,
+                                             const cv::Point& mask_offset,
                                              float& avg_depth,
                                              cv::Point3i &match_pos,
                                              cv::Point3i &match_init_pos,
@@ -82,94 +221,129 @@ bool HumanClassifier::TemplateClassification(const cv::Mat& depth_image,
                                              float& match_variance,
                                              float& match_deviation,
                                              TemplateType &template_type,
-                                             Roi &measurement) const{
+                                             Roi &measurement,
+                                             MatchHint& hint) const{
 
+    MatchBuffers& buffers = getMatchBuffers();
     cv::Rect maskBox;
-    cv::Mat map_dt;
-    cv::Mat contour_line;
-    cv::Mat mask_copy;
+    cv::Mat& map_dt = buffers.map_dt;
+    cv::Mat& contour_line = buffers.contour_line;
 
-    mask.copyTo(measurement.mask);
-    mask.copyTo(mask_copy);
+    measurement.mask = mask;
 
     // ---------- IMAGE PRE-PROCESSING ----------
 
-    // TODO dont creat a Mat mask, just give human_classifier_.Classify a vector of 2D points!
-    // find external contours only
-    findContours(mask_copy, measurement.contour, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE);
+    // find external contours only, in image coordinates. findContours ignores the outer pixels of its input, so add
+    // a one pixel border for objects that touch the edge of the mask.
+    copyMakeBorder(mask, buffers.contour_input, 1, 1, 1, 1, cv::BORDER_CONSTANT, cv::Scalar(0));
+    findContours(buffers.contour_input, measurement.contour, CV_RETR_EXTERNAL, CV_CHAIN_APPROX_SIMPLE,
+                 mask_offset - cv::Point(1, 1));
 
-    // create and outlined contour
-    contour_line = cv::Mat::zeros(depth_image.rows, depth_image.cols, CV_8UC1);
-    drawContours(contour_line, measurement.contour, -1, cv::Scalar(255), dt_line_width_);
+    if (measurement.contour.empty()) {
+        match_pos = cv::Point3i(0,0,0);
+        match_init_pos = cv::Point3i(0,0,0);
+        match_error = 0;
+        match_variance = 0;
+        match_deviation = 0;
+        template_type = NoMatch;
+        measurement.templType = NoMatch;
+        hint.valid = false;
+        return false;
+    }
 
     // create a minimum area bounding box
     maskBox = boundingRect(measurement.contour[0]);
 
-    // invert the outline, from white to black
-    threshold(contour_line(maskBox), contour_line, 250, 255, CV_THRESH_BINARY_INV);
+    // create the outline of the contour, black on white, only in the bounding box. The border around it stays white.
+    contour_line.create(maskBox.height + 2 * border_size_, maskBox.width + 2 * border_size_, CV_8UC1);
+    contour_line.setTo(cv::Scalar(255));
 
-    // create a border on the image
-    copyMakeBorder(contour_line, contour_line, border_size_, border_size_, border_size_, border_size_,
-            cv::BORDER_CONSTANT, cv::Scalar(255,255,255) );
+    cv::Mat contour_box = contour_line(cv::Rect(border_size_, border_size_, maskBox.width, maskBox.height));
+    drawContours(contour_box, measurement.contour, -1, cv::Scalar(0), dt_line_width_, 8, cv::noArray(), INT_MAX, -maskBox.tl());
 
     // create the distance transform map from the contour line
     distanceTransform(contour_line, map_dt, CV_DIST_L2, 5);
 
+    // Gradient in X
+    Sobel(map_dt, buffers.grad_x, CV_32FC1, 1, 0, 3, 1, 0, cv::BORDER_DEFAULT);
+    // Gradient in Y
+    Sobel(map_dt, buffers.grad_y, CV_32FC1, 0, 1, 3, 1, 0, cv::BORDER_DEFAULT);
+
 
     // ---------- TEMPLATE MATCHING ----------
 
-    std::vector<std::vector <cv::Point> > templates_resized;
+    std::vector<TemplateView> templates_resized;
+
+    if (avg_depth <= 0)
+        std::cout << "[" << module_name_ << "] " << "Incorrect depth value = "<< avg_depth << std::endl;
 
-    // Resize templates according to the depth of the object
-    templates_resized.push_back(std::vector<cv::Point>());
-    ResizeTemplate(kTemplatesOriginal[0], avg_depth, -5, FaceFront, templates_resized.back());
+    // Take the templates scaled according to the depth of the object from the bank
+    for (uint i = 0; i < template_bank_.size(); i++)
+        templates_resized.push_back(template_bank_[i].view(ScaleFactor(static_cast<TemplateType>(i), avg_depth)));
 
-    templates_resized.push_back(std::vector<cv::Point>());
-    ResizeTemplate(kTemplatesOriginal[1], avg_depth, -8, FaceLeft, templates_resized.back());
+    std::vector<TemplateMatch> matches(templates_resized.size());
+    cv::Mat mask_roi = mask(maskBox - mask_offset);
+    bool warm_match = false;
+
+    // start from the match of the previous measurement of this object, if there is one
+    if (hint.valid && hint.type >= 0 && hint.type < (int)templates_resized.size()) {
+        cv::Vec3f init_pos(hint.pos.x - maskBox.x + border_size_, hint.pos.y - maskBox.y + border_size_, hint.angle);
+
+        TemplateMatch& m = matches[hint.type];
+        m.valid = PerfectMatch(mask_roi, map_dt, buffers.grad_x, buffers.grad_y, templates_resized[hint.type], m.pos, m.init_pos, m.error, m.variance, m.deviation, &init_pos);
+
+        // if the template still fits, the others are not tried
+        warm_match = m.valid && m.error < max_template_err_;
+    }
 
-    templates_resized.push_back(std::vector<cv::Point>());
-    ResizeTemplate(kTemplatesOriginal[2], avg_depth, -8, FaceRight, templates_resized.back());
+    if (!warm_match) {
+        // match all templates from scratch. The debug mode paints in the DT map, so it matches them one by one.
+        std::vector<TemplateMatch> cold_matches(templates_resized.size());
+        ed::perception::parallelFor(templates_resized.size(), MatchTask(*this, mask_roi, map_dt, buffers.grad_x, buffers.grad_y,
+                                                                                templates_resized, cold_matches),
+                                    parallel_matching_ && !debug_mode_ ? 0 : 1);
+
+        for (uint i = 0; i < matches.size(); i++) {
+            if (cold_matches[i].valid && (!matches[i].valid || cold_matches[i].error < matches[i].error))
+                matches[i] = cold_matches[i];
+        }
+    }
 
     // initialize error and template type
     match_error = 0;
     measurement.templType = NoMatch;
     template_type = NoMatch;
 
-    for (uint i = 0; i < templates_resized.size(); i++) {
-        cv::Point3i current_loc;
-        cv::Point3i current_init_loc;
+    for (uint i = 0; i < matches.size(); i++) {
+        const TemplateMatch& current = matches[i];
         cv::Rect template_box_relative;
-        float current_err;
-        float current_variance;
-        float current_deviation;
 
         // TODO decide if i should pass the info like error, variance, stance, all in the measurement or separate variables for all
-        // match the template with the DT map
-        if (PerfectMatch(measurement.mask(maskBox), map_dt, templates_resized[i], current_loc, current_init_loc, current_err, current_variance, current_deviation)){
+        if (current.valid){
 
-//            std::cout << "[" << kModuleName << "] " << "Match error for templt " << i << ": " << current_err << std::endl;
+//            std::cout << "[" << kModuleName << "] " << "Match error for templt " << i << ": " << current.error << std::endl;
 
             // update information regarding the matching, error, template type, etc
-            if (match_error > current_err || measurement.templType == NoMatch){
-                template_box_relative = boundingRect(templates_resized[i]);
+            if (match_error > current.error || measurement.templType == NoMatch){
+                template_box_relative = templates_resized[i].box;
 
-                match_pos = current_loc;
-                match_init_pos = current_init_loc;
-                match_error = current_err;
-                match_variance = current_variance;
-                match_deviation = current_deviation;
+                match_pos = current.pos;
+                match_init_pos = current.init_pos;
+                match_error = current.error;
+                match_variance = current.variance;
+                match_deviation = current.deviation;
 
                 measurement.templType = static_cast<TemplateType>(i);
                 template_type = static_cast<TemplateType>(i);
 
-                measurement.template_box = cv::Rect (ClipInt(current_loc.x + maskBox.x - border_size_, 0, depth_image.cols),
-                                                     ClipInt(current_loc.y + maskBox.y - border_size_, 0, depth_image.rows),
+                measurement.template_box = cv::Rect (ClipInt(current.pos.x + maskBox.x - border_size_, 0, depth_image.cols),
+                                                     ClipInt(current.pos.y + maskBox.y - border_size_, 0, depth_image.rows),
                                                      ClipInt(template_box_relative.width, 1, depth_image.rows - template_box_relative.width),
                                                      ClipInt(template_box_relative.height, 1, depth_image.cols - template_box_relative.height));
 
                 measurement.matchLocImg = cv::Point3i(ClipInt(measurement.template_box.x + template_box_relative.width/2, 0, depth_image.cols),
                                                       ClipInt(measurement.template_box.y + template_box_relative.height/2, 0, depth_image.rows),
-                                                      current_loc.z);
+                                                      current.pos.z);
             }
         }
         else{
@@ -177,6 +351,14 @@ bool HumanClassifier::TemplateClassification(const cv::Mat& depth_image,
         }
     }
 
+    // remember a good match as initial guess for the next measurement
+    hint.valid = (template_type != NoMatch && match_error < max_template_err_);
+    if (hint.valid) {
+        hint.type = template_type;
+        hint.pos = cv::Point2f(match_pos.x + maskBox.x - border_size_, match_pos.y + maskBox.y - border_size_);
+        hint.angle = (match_pos.z * M_PI) / 180.0;
+    }
+
 
     // ---------- DEBUGGING ----------
 
@@ -204,12 +386,13 @@ bool HumanClassifier::TemplateClassification(const cv::Mat& depth_image,
 
             // draw the template over the place where it matched
             TemplateType best_templ= measurement.templType;
-            for (uint a = 0; a < templates_resized.at(best_templ).size(); a++) {
+            const TemplateView& best_pts = templates_resized.at(best_templ);
+            for (uint a = 0; a < best_pts.size(); a++) {
                 // select point to be painted on the dt map, apply rotation transformations
                 cv::Point pos(floor( match_pos.x +
-                                 (templates_resized.at(best_templ)[a].x * cos(angleRad) - templates_resized.at(best_templ)[a].y * sin(angleRad))),
+                                 (best_pts.x[a] * cos(angleRad) - best_pts.y[a] * sin(angleRad))),
                               floor( match_pos.y +
-                                 (templates_resized.at(best_templ)[a].x * sin(angleRad) + templates_resized.at(best_templ)[a].y * cos(angleRad))));
+                                 (best_pts.x[a] * sin(angleRad) + best_pts.y[a] * cos(angleRad))));
 
                 // paint this pixel if its inside the image
                 if (pos.x >= 0 && pos.y >= 0 && pos.x < map_dt.cols && pos.y < map_dt.rows) {
@@ -242,19 +425,20 @@ bool HumanClassifier::TemplateClassification(const cv::Mat& depth_image,
 
 bool HumanClassifier::PerfectMatch(const cv::Mat& mask,
                                    cv::Mat &map_dt,
-                                   std::vector<cv::Point> template_pts,
+                                   const cv::Mat& grad_x,
+                                   const cv::Mat& grad_y,
+                                   const TemplateView& template_pts,
                                    cv::Point3i& best_pos,
                                    cv::Point3i& start_pos,
                                    float& best_error,
                                    float& variance,
-                                   float& deviation) const{
+                                   float& deviation,
+                                   const cv::Vec3f* initial_pos) const{
 
     float err;              // error value
     int occupancy_best;
     int occupancy;
     int start_col;
-    cv::Mat grad_x;			// sobel gradient in X
-    cv::Mat grad_y;			// sobel gradient in Y
     cv::Vec3f curr_grad;	// gradient value
     cv::Vec3f pos;			// position to test
     cv::Vec3f prev_grad;	// old gradient value
@@ -268,7 +452,7 @@ bool HumanClassifier::PerfectMatch(const cv::Mat& mask,
     cv::Scalar meanErr;
     cv::Scalar devErr;
 
-    templtBox = boundingRect(template_pts);
+    templtBox = template_pts.box;
 
     // discard regions that are too small for the given template
     if (map_dt.rows - 2*border_size_ < templtBox.height || map_dt.cols - 2*border_size_ < templtBox.width) {
@@ -291,32 +475,40 @@ bool HumanClassifier::PerfectMatch(const cv::Mat& mask,
     colCounter = cv::Rect(0,0, mask.cols / num_slices_matching_, mask.rows);
     variance = 0;
 
-    // calculate best start position, divide the regions in vertical sections and choose the most occupied
-    for (int i = 0; i < num_slices_matching_; i++) {
-        // count number of non-black pixels of the current region
-        occupancy = cv::countNonZero( mask(cv::Rect((mask.cols / num_slices_matching_) * i, 0, (mask.cols / num_slices_matching_), mask.rows)));
-
-        if (occupancy > occupancy_best) {
-            occupancy_best = occupancy;
-            // zone = midle of the zone - offset of half the template
-            start_col = ClipInt(floor(((mask.cols / num_slices_matching_) * i) - (templtBox.width/2)), 0, mask.cols);
+    if (initial_pos && (*initial_pos)[0] >= 0 && (*initial_pos)[0] < map_dt.cols &&
+            (*initial_pos)[1] >= 0 && (*initial_pos)[1] < map_dt.rows) {
+        // initial position given, e.g. the match of a previous measurement
+        pos = *initial_pos;
+    } else if (pyramid_levels_ > 0) {
+        // search the initial position on a DT pyramid
+        pos = CoarseToFineSearch(map_dt, template_pts);
+    } else {
+        // calculate best start position, divide the regions in vertical sections and choose the most occupied
+        for (int i = 0; i < num_slices_matching_; i++) {
+            // count number of non-black pixels of the current region
+            occupancy = cv::countNonZero( mask(cv::Rect((mask.cols / num_slices_matching_) * i, 0, (mask.cols / num_slices_matching_), mask.rows)));
+
+            if (occupancy > occupancy_best) {
+                occupancy_best = occupancy;
+                // zone = midle of the zone - offset of half the template
+                start_col = ClipInt(floor(((mask.cols / num_slices_matching_) * i) - (templtBox.width/2)), 0, mask.cols);
+            }
         }
-    }
 
-    // set intial position, add borderSize or remove it for original location
-    pos = cv::Vec3f(start_col + border_size_, border_size_, 0.0);
-    start_pos = cv::Point3i(start_col + border_size_, border_size_, 0.0);
+        // set intial position, add borderSize or remove it for original location
+        pos = cv::Vec3f(start_col + border_size_, border_size_, 0.0);
+    }
 
-    // Gradient in X
-    Sobel(map_dt, grad_x, CV_32FC1, 1, 0, 3, 1, 0, cv::BORDER_DEFAULT);
-    // Gradient in Y
-    Sobel(map_dt, grad_y, CV_32FC1, 0, 1, 3, 1, 0, cv::BORDER_DEFAULT);
+    start_pos = cv::Point3i(floor(pos[0]), floor(pos[1]), floor((pos[2]*180.0)/M_PI));
 
 
     //---------------------------------------------------------
 
 
     // RPROP algorithm
+    err_values.reserve(template_pts.size());
+    curr_err_values.reserve(template_pts.size());
+
     for (int i = 0; i < match_iterations_; i++) {
         curr_err_values.clear();
         err = ErrorFunction(grad_x, grad_y, map_dt, template_pts, pos, curr_grad, curr_err_values);
@@ -332,11 +524,8 @@ bool HumanClassifier::PerfectMatch(const cv::Mat& mask,
 
         // update best error
         if (err < best_error && err > 0) {
-            err_values.clear();
-
             // backup error values for the best match, to calculate mean and deviation later
-            for (uint x = 0; x < curr_err_values.size(); x++)
-                err_values.push_back(curr_err_values[x]);
+            err_values.assign(curr_err_values.begin(), curr_err_values.end());
 
             // backup best error
             best_error = err;
@@ -390,60 +579,213 @@ bool HumanClassifier::PerfectMatch(const cv::Mat& mask,
 }
 
 
+cv::Vec3f HumanClassifier::CoarseToFineSearch(const cv::Mat& map_dt,
+                                              const TemplateView& template_pts) const{
+
+    // rotations tried on the coarsest level (radians), a head is roughly upright
+    const int kNumAngles = 5;
+    const float kAngleStep = 0.1;
+
+    const cv::Rect& template_box = template_pts.box;
+    uint n = template_pts.size();
+
+    // build the pyramid, each level half the size of the previous one. Distances are halved as well, so every
+    // level is (approximately) the DT of the downscaled contour. Stop before the template becomes too small.
+    std::vector<cv::Mat> pyramid(1, map_dt);
+    while ((int)pyramid.size() <= pyramid_levels_ &&
+           (template_box.width >> pyramid.size()) >= 4 && (template_box.height >> pyramid.size()) >= 4) {
+        cv::Mat level;
+        cv::resize(pyramid.back(), level, cv::Size(pyramid.back().cols / 2, pyramid.back().rows / 2), 0, 0, cv::INTER_AREA);
+        level *= 0.5;
+        pyramid.push_back(level);
+    }
+
+    int top = pyramid.size() - 1;
+    float scale = 1.0 / (1 << top);
+    const cv::Mat& coarse_dt = pyramid[top];
+
+    // all angles tried are on a grid with the step of the finest level, which halves the step of the coarsest
+    // level on every level. Rotate the template once for every angle on that grid that can be reached.
+    int angle_bins = 1 << top;
+    int max_angle_idx = (kNumAngles / 2 + 1) * angle_bins;
+    float angle_grid = kAngleStep / angle_bins;
+
+    std::vector<float> rotated_x((2 * max_angle_idx + 1) * n);
+    std::vector<float> rotated_y((2 * max_angle_idx + 1) * n);
+    for (int a = -max_angle_idx; a <= max_angle_idx; a++) {
+        float angle_sin = sin(a * angle_grid);
+        float angle_cos = cos(a * angle_grid);
+        float* rx = &rotated_x[(a + max_angle_idx) * n];
+        float* ry = &rotated_y[(a + max_angle_idx) * n];
+
+        for (uint i = 0; i < n; i++) {
+            rx[i] = template_pts.x[i] * angle_cos - template_pts.y[i] * angle_sin;
+            ry[i] = template_pts.x[i] * angle_sin + template_pts.y[i] * angle_cos;
+        }
+    }
+
+    // exhaustive search on the coarsest level, in a window in which the template lies within the DT map (outside
+    // it, points are clipped to the border and the error means nothing). The head is at the top of the region,
+    // so the top of the template may be at most half a template height below the top of the mask (which starts
+    // at border_size_)
+    int x_min = std::max(0, (int)ceil(-template_box.x * scale));
+    int x_max = std::min(coarse_dt.cols, (int)floor(coarse_dt.cols - (template_box.x + template_box.width) * scale) + 1);
+    int y_min = std::max(0, (int)ceil(-template_box.y * scale));
+    int y_max = std::min(coarse_dt.rows, (int)ceil((border_size_ + template_box.height / 2 - template_box.y) * scale) + 1);
+    if (x_max <= x_min) {
+        x_min = 0;
+        x_max = coarse_dt.cols;
+    }
+    if (y_max <= y_min) {
+        y_min = 0;
+        y_max = coarse_dt.rows;
+    }
+
+    // on a level scaled by 1/2^l, 2^l neighbouring contour points fall in (about) the same pixel, so only every
+    // 2^l-th point is evaluated, but at least kMinPoints points
+    uint step = levelPointStep(top, n);
+
+    cv::Point3i best(border_size_ * scale, border_size_ * scale, 0);    // (x, y, angle index)
+    float best_err = std::numeric_limits<float>::max();
+
+    for (int y = y_min; y < y_max; y++) {
+        for (int x = x_min; x < x_max; x++) {
+            for (int a = 0; a < kNumAngles; a++) {
+                int angle_idx = (a - kNumAngles / 2) * angle_bins;
+                uint offset = (angle_idx + max_angle_idx) * n;
+                float err = ChamferError(coarse_dt, &rotated_x[offset], &rotated_y[offset], n, step, scale, x, y);
+
+                if (err < best_err) {
+                    best_err = err;
+                    best = cv::Point3i(x, y, angle_idx);
+                }
+            }
+        }
+    }
+
+    // refine on the finer levels, in the neighbourhood of the position found on the previous level
+    for (int l = top - 1; l >= 0; l--) {
+        scale = 1.0 / (1 << l);
+        step = levelPointStep(l, n);
+        cv::Point3i center(best.x * 2, best.y * 2, best.z);
+        best_err = std::numeric_limits<float>::max();
+
+        for (int dy = -1; dy <= 1; dy++) {
+            for (int dx = -1; dx <= 1; dx++) {
+                for (int da = -1; da <= 1; da++) {
+                    cv::Point3i anchor(center.x + dx, center.y + dy, center.z + da * (1 << l));
+                    uint offset = (anchor.z + max_angle_idx) * n;
+                    float err = ChamferError(pyramid[l], &rotated_x[offset], &rotated_y[offset], n, step, scale, anchor.x, anchor.y);
+
+                    if (err < best_err) {
+                        best_err = err;
+                        best = anchor;
+                    }
+                }
+            }
+        }
+    }
+
+    // keep the position inside the limits used by the RPROP refinement
+    return cv::Vec3f(std::max(0, std::min(best.x, map_dt.cols - 1)),
+                     std::max(0, std::min(best.y, map_dt.rows - 1)),
+                     best.z * angle_grid);
+}
+
+
+float HumanClassifier::ChamferError(const cv::Mat& map_dt,
+                                    const float* pts_x,
+                                    const float* pts_y,
+                                    uint n,
+                                    uint step,
+                                    float scale,
+                                    float x,
+                                    float y) const{
+
+    float err = 0;
+    uint count = 0;
+
+    for (uint i = 0; i < n; i += step, count++){
+        int px = ClipInt(floor(x + pts_x[i] * scale), 0, map_dt.cols - 1);
+        int py = ClipInt(floor(y + pts_y[i] * scale), 0, map_dt.rows - 1);
+
+        float d = map_dt.ptr<float>(py)[px];
+        err += d * d;
+    }
+
+    return count == 0 ? 0 : err / count;
+}
+
+
+unsigned int HumanClassifier::levelPointStep(int level, unsigned int n) const{
+
+    // minimum number of template points evaluated on a pyramid level
+    const unsigned int kMinPoints = 32;
+
+    return std::max(1u, std::min(1u << level, n / kMinPoints));
+}
+
+
 float HumanClassifier::ErrorFunction(const cv::Mat& grad_x,
                                      const cv::Mat& grad_y,
                                      const cv::Mat& distance_transf,
-                                     std::vector<cv::Point>& template_pts,
+                                     const TemplateView& template_pts,
                                      cv::Vec3f& anchor,
                                      cv::Vec3f& grad,
                                      std::vector<float>& err_values) const{
 
-    cv::Point pos;
+    MatchBuffers& buffers = getMatchBuffers();
+    uint n = template_pts.size();
     float err = 0;
-    float gx;
-    float gy;
-    float d;
-    std::vector<cv::Point> pos_tested;
+    float grad_dx = 0;
+    float grad_dy = 0;
+    float grad_da = 0;
     float anchor_sin = sin(anchor[2]);
     float anchor_cos = cos(anchor[2]);
 
-    // reset the gradient value
-    grad = cv::Vec3f(0.0, 0.0, 0.0);
+    if (n == 0) {
+        grad = cv::Vec3f(0.0, 0.0, 0.0);
+        return 0;
+    }
 
-    // test all template points
-    for (uint i = 0; i < template_pts.size(); i++){
+    // set testing positions, with transformation (rotation)
+    buffers.pos_x.resize(n);
+    buffers.pos_y.resize(n);
+    TransformTemplate(template_pts, anchor, anchor_sin, anchor_cos, distance_transf.cols, distance_transf.rows,
+                      &buffers.pos_x[0], &buffers.pos_y[0]);
 
-        // set testing position, with transformation (rotation)
-        pos.x = ClipInt(floor(anchor[0] + (template_pts[i].x * anchor_cos - template_pts[i].y * anchor_sin) ),
-                             0, distance_transf.cols-1);
+    // positions tested in this call are marked with a new epoch
+    uint epoch = buffers.NextEpoch(distance_transf.rows * distance_transf.cols);
+    uint* stamps = &buffers.stamps[0];
 
-        pos.y = ClipInt(floor(anchor[1] + (template_pts[i].x * anchor_sin + template_pts[i].y * anchor_cos) ),
-                             0 , distance_transf.rows-1);
+    // test all template points
+    for (uint i = 0; i < n; i++){
+        int x = buffers.pos_x[i];
+        int y = buffers.pos_y[i];
 
         // avoid points that have already been tested
-        if (find(pos_tested.begin(), pos_tested.end(), pos) != pos_tested.end()) {
-            //ROS_INFO("Already tested (%d, %d)", pos.x, pos.y);
-        } else {
-            gx = grad_x.at<float>(pos);
-            gy = grad_y.at<float>(pos);
-            d = distance_transf.at<float>(pos) * distance_transf.at<float>(pos);
-
-            grad[0] += gx;	// gradient in X
-            grad[1] += gy;	// gradient in Y
-            grad[2] += gx * (-template_pts[i].x * anchor_sin - template_pts[i].y * anchor_cos)
-                    + gy * (template_pts[i].x * anchor_cos + template_pts[i].y * anchor_sin);
-
-            err += d;	// error for this position, or "distance"
-
-            err_values.push_back(d);
-            pos_tested.push_back(pos);
-        }
+        uint& stamp = stamps[y * distance_transf.cols + x];
+        if (stamp == epoch)
+            continue;
+        stamp = epoch;
 
-        // a warning just in case..
-        if (pos.x > distance_transf.cols || pos.y > distance_transf.rows || pos.x < 0 || pos.y < 0)
-            std::cout << "[" << module_name_ << "] " << "Position outside of the map ("<< pos.x << ", " << pos.y <<")" << std::endl;
+        float gx = grad_x.ptr<float>(y)[x];
+        float gy = grad_y.ptr<float>(y)[x];
+        float dt = distance_transf.ptr<float>(y)[x];
+        float d = dt * dt;
+
+        grad_dx += gx;	// gradient in X
+        grad_dy += gy;	// gradient in Y
+        grad_da += gx * (-template_pts.x[i] * anchor_sin - template_pts.y[i] * anchor_cos)
+                + gy * (template_pts.x[i] * anchor_cos + template_pts.y[i] * anchor_sin);
+
+        err += d;	// error for this position, or "distance"
+
+        err_values.push_back(d);
     }
 
+    grad = cv::Vec3f(grad_dx, grad_dy, grad_da);
+
     return err;
 }
 
@@ -466,21 +808,18 @@ bool HumanClassifier::FaceDetection(const cv::Mat &color_img, Roi &measurement)
         normalize(cascadeImg, cascadeImg, 0, 255, cv::NORM_MINMAX, CV_8UC1);
 
         // detect faces
-        cv::CascadeClassifier kDetectFaceFront;
-        cv::CascadeClassifier kDetectFaceProfile;
-        if (!kDetectFaceFront.load(cascade_path_ + "haarcascade_frontalface_default.xml") ||
-                !kDetectFaceProfile.load(cascade_path_ + "haarcascade_profileface.xml")) {
+        cv::CascadeClassifier* kDetectFaceFront = ed::perception::CascadeRegistry::get(cascade_path_ + "haarcascade_frontalface_default.xml");
+        cv::CascadeClassifier* kDetectFaceProfile = ed::perception::CascadeRegistry::get(cascade_path_ + "haarcascade_profileface.xml");
+        if (!kDetectFaceFront || !kDetectFaceProfile) {
             std::cout << "[" << module_name_ << "] " << "Unable to load all haar cascade files" << std::endl;
             return false;
-        } else {
-//            std::cout << "[" << kModuleName << "] " << "Haar cascade XML files sucessfully loaded." << std::endl;
         }
 
-        kDetectFaceFront.detectMultiScale(cascadeImg, facesFront, 1.2, 2, 0|CV_HAAR_SCALE_IMAGE);
+        kDetectFaceFront->detectMultiScale(cascadeImg, facesFront, 1.2, 2, 0|CV_HAAR_SCALE_IMAGE);
 
         // only search profile faces if the frontal face detection failed
         if (facesFront.size() == 0){
-            kDetectFaceProfile.detectMultiScale(cascadeImg, facesProfile, 1.1, 1, 0|CV_HAAR_SCALE_IMAGE);
+            kDetectFaceProfile->detectMultiScale(cascadeImg, facesProfile, 1.1, 1, 0|CV_HAAR_SCALE_IMAGE);
         }
 
         // confirm the candidate is human if a face is detected
@@ -551,16 +890,7 @@ void HumanClassifier::OptimizeHeadRoi(cv::Rect& templateArea, TemplateType templ
 }
 
 
-float HumanClassifier::ResizeTemplate(std::vector<cv::Point> template_src,
-                                      float depth,
-                                      float alpha,
-                                      TemplateType type,
-                                      std::vector<cv::Point>& template_dst) const{
-
-    float scaleFactor;
-
-    if (depth <= 0)
-        std::cout << "[" << module_name_ << "] " << "Incorrect depth value = "<< depth << std::endl;
+float HumanClassifier::ScaleFactor(TemplateType type, float depth) const{
 
     // scale_factor = -15,763 X + 106,33 (linear)
     // scale_factor = -52.6 * log(X) + 114.06 (logarithmic)
@@ -569,21 +899,57 @@ float HumanClassifier::ResizeTemplate(std::vector<cv::Point> template_src,
 
     // use different scaling functions for different template types
     if (type == FaceFront)
-        scaleFactor = (359.29 * pow(depth, -1.154)) + alpha;
+        return (359.29 * pow(depth, -1.154)) - 5;
     else if (type == FaceLeft || type == FaceRight)
-        scaleFactor = (299.07 * pow(depth, -1.156)) + alpha;
+        return (299.07 * pow(depth, -1.156)) - 8;
     else
-        scaleFactor = (412.21 * pow(depth, -1.256)) + alpha;
+        return (412.21 * pow(depth, -1.256));
+}
 
-    // apply the scalling to each point
-    for (uint j = 0; j < template_src.size(); j++)
-        template_dst.push_back(	cv::Point(
-                floor(template_src[j].x * scaleFactor/100),
-                floor(template_src[j].y * scaleFactor/100)));
 
-    return scaleFactor;
+void HumanClassifier::BuildTemplateBank(){
+
+    template_bank_.clear();
+    template_bank_.resize(kTemplatesOriginal.size());
+
+    for (uint t = 0; t < kTemplatesOriginal.size(); t++) {
+        const std::vector<cv::Point>& template_src = kTemplatesOriginal[t];
+        TemplateBank& bank = template_bank_[t];
+
+        // one bin per percentage of scale between the farthest and the closest depth
+        int min_scale = std::max(1, (int)floor(ScaleFactor(static_cast<TemplateType>(t), kBankMaxDepth)));
+        int max_scale = std::max(min_scale, (int)ceil(ScaleFactor(static_cast<TemplateType>(t), kBankMinDepth)));
+        uint num_bins = max_scale - min_scale + 1;
+
+        bank.min_scale = min_scale;
+        bank.points.x.resize(num_bins * template_src.size());
+        bank.points.y.resize(num_bins * template_src.size());
+        bank.offsets.resize(num_bins + 1);
+        bank.boxes.resize(num_bins);
+
+        std::vector<cv::Point> template_dst(template_src.size());
+        for (uint b = 0; b < num_bins; b++) {
+            uint offset = b * template_src.size();
+            float scale_factor = min_scale + b;
+
+            // apply the scalling to each point
+            for (uint j = 0; j < template_src.size(); j++) {
+                template_dst[j] = cv::Point(floor(template_src[j].x * scale_factor/100),
+                                            floor(template_src[j].y * scale_factor/100));
+
+                bank.points.x[offset + j] = template_dst[j].x;
+                bank.points.y[offset + j] = template_dst[j].y;
+            }
+
+            bank.offsets[b] = offset;
+            bank.boxes[b] = template_dst.empty() ? cv::Rect() : boundingRect(template_dst);
+        }
+
+        bank.offsets[num_bins] = num_bins * template_src.size();
+    }
 }
 
+
 int HumanClassifier::ClipInt(int val, int min, int max) const{
     return val <= min ? min : val >= max ? max : val;
 }
@@ -598,7 +964,9 @@ bool HumanClassifier::Initializations(bool debug_mode,
                                       int dt_line_width,
                                       double max_template_err,
                                       int border_size,
-                                      int num_slices_matching) {
+                                      int num_slices_matching,
+                                      int pyramid_levels,
+                                      bool parallel_matching) {
 
     debug_folder_ = debug_folder;
     debug_mode_ = debug_mode;
@@ -611,6 +979,8 @@ bool HumanClassifier::Initializations(bool debug_mode,
     max_template_err_ = max_template_err;
     border_size_ = border_size;
     num_slices_matching_ = num_slices_matching;
+    pyramid_levels_ = pyramid_levels;
+    parallel_matching_ = parallel_matching;
 
 	// clean/create debug folder
     if (debug_mode){
@@ -638,6 +1008,8 @@ bool HumanClassifier::Initializations(bool debug_mode,
         return false;
     }
 
+    BuildTemplateBank();
+
 
     // initialize structuing element for morphological operations
     morph_element_ = cv::getStructuringElement(cv::MORPH_ELLIPSE, cv::Size(4, 4), cv::Point(-1, -1));
@@ -54,8 +54,11 @@ class HumanClassifier {
 
         // ##### TEMPLATE MATCHING VARIABLES #####
         std::vector<std::vector<cv::Point> > kTemplatesOriginal;    /*!< Original templates, without scaling */
+        std::vector<TemplateBank> template_bank_;  /*!< Templates scaled for all depths, one bank per template type */
         cv::Mat morph_element_;      /*!< Morphologic operations structural element */
         int num_slices_matching_;     /*!< Number of slices to calculate best match initial position */
+        int pyramid_levels_;          /*!< Levels of the DT pyramid used to search the initial position (0 uses the slices instead) */
+        bool parallel_matching_;      /*!< Match the templates concurrently */
 
         std::string cascade_path_;
 
@@ -74,18 +77,22 @@ class HumanClassifier {
 		// Default destructor
 		virtual ~HumanClassifier();
 
-        // Method that classifies a new candidate as human or not human
+        // Method that classifies a new candidate as human or not human. The mask only covers the bounding box of
+        // the candidate, mask_offset is the position of its top-left corner in the image.
         bool Classify(const cv::Mat& depth_img,
                       const cv::Mat& color_img,
                       const cv::Mat& mask,
+                      const cv::Point& mask_offset,
                       float& avg_depth,
                       float& template_match_error,
                       float &template_match_deviation,
-                      std::string &template_stance) const;
+                      std::string &template_stance,
+                      MatchHint& hint) const;
 
         // Tries to fit a template on the given measurement
         bool TemplateClassification(const cv::Mat& depth_image,
                                     const cv::Mat& mask,
+                                    const cv::Point& mask_offset,
                                     float& avg_depth,
                                     cv::Point3i& match_pos,
                                     cv::Point3i& match_init_pos,
@@ -93,23 +100,45 @@ class HumanClassifier {
                                     float& match_variance,
                                     float& match_deviation,
                                     TemplateType &template_type,
-                                    Roi &measurement) const;
+                                    Roi &measurement,
+                                    MatchHint& hint) const;
 
         // Perfect Match algorithm used to fit the template
         bool PerfectMatch(const cv::Mat& mask,
                           cv::Mat& map_dt,
-                          std::vector<cv::Point> template_pts,
+                          const cv::Mat& grad_x,
+                          const cv::Mat& grad_y,
+                          const TemplateView& template_pts,
                           cv::Point3i &best_pos,
                           cv::Point3i& start_pos,
                           float &best_error,
                           float& variance,
-                          float& deviation) const;
+                          float& deviation,
+                          const cv::Vec3f* initial_pos = 0) const;
+
+        // Searches the initial template position coarse-to-fine, exhaustively on the coarsest level of a DT pyramid
+        cv::Vec3f CoarseToFineSearch(const cv::Mat& map_dt,
+                                     const TemplateView& template_pts) const;
+
+        // Average squared distance of every step-th (already rotated) template point, scaled and placed at (x, y), in the DT map
+        float ChamferError(const cv::Mat& map_dt,
+                           const float* pts_x,
+                           const float* pts_y,
+                           unsigned int n,
+                           unsigned int step,
+                           float scale,
+                           float x,
+                           float y) const;
+
+        // Step between the template points evaluated on the given DT pyramid level, for a template of n points
+        unsigned int levelPointStep(int level, unsigned int n) const;
 
         // function used to calculate the fitting error on the given position
+        // (each map position is only counted once; errValues gets the squared distance of each counted position)
         float ErrorFunction(const cv::Mat& gradX,
                             const cv::Mat& gradY,
                             const cv::Mat& imageDT,
-                            std::vector<cv::Point>& template_pts,
+                            const TemplateView& template_pts,
                             cv::Vec3f& anchor,
                             cv::Vec3f& grad,
                             std::vector<float>& errValues) const;
@@ -123,12 +152,11 @@ class HumanClassifier {
                              const cv::Mat &color_img,
                              cv::Rect& headArea) const;
 
-        // Resizes a template according to a certain depth
-        float ResizeTemplate(std::vector<cv::Point> src_template,
-                             float depth,
-                             float alpha,
-                             TemplateType type,
-                             std::vector<cv::Point>& dst_template) const;
+        // Scale (in percentage) of a template of the given type for an object at a certain depth
+        float ScaleFactor(TemplateType type, float depth) const;
+
+        // Scales the original templates for the range of depths they are matched at
+        void BuildTemplateBank();
 
         // clips a integer number between a min and a max
         int ClipInt(int val, int min, int max) const;
@@ -143,7 +171,9 @@ class HumanClassifier {
                              int dt_line_width,
                              double max_template_err,
                              int border_size,
-                             int num_slices_matching);
+                             int num_slices_matching,
+                             int pyramid_levels,
+                             bool parallel_matching);
 
         // Loads a template with the given name and converts it into 2D points
         bool LoadTemplate(const std::string& template_path, std::vector<std::vector<cv::Point> >& template_list);
@@ -22,6 +22,85 @@ enum TemplateType {
     FaceFront = 0, FaceLeft = 1, FaceRight = 2, FaceBack = 3, NoMatch = -1
 };
 
+/**
+ * Template points in structure-of-arrays layout, as used by the template matching
+ */
+struct TemplatePoints {
+    std::vector<float> x;	/*!< X coordinates */
+    std::vector<float> y;	/*!< Y coordinates */
+
+    TemplatePoints() {}
+
+    explicit TemplatePoints(const std::vector<cv::Point>& pts) { assign(pts); }
+
+    void assign(const std::vector<cv::Point>& pts) {
+        x.resize(pts.size());
+        y.resize(pts.size());
+        for (unsigned int i = 0; i < pts.size(); i++) {
+            x[i] = pts[i].x;
+            y[i] = pts[i].y;
+        }
+    }
+
+    unsigned int size() const { return x.size(); }
+};
+
+/**
+ * Read-only view on the points of one template, e.g. one scale of a template bank
+ */
+struct TemplateView {
+    const float* x;		/*!< X coordinates */
+    const float* y;		/*!< Y coordinates */
+    unsigned int n;		/*!< Number of points */
+    cv::Rect box;		/*!< Bounding box of the points */
+
+    TemplateView() : x(0), y(0), n(0) {}
+
+    unsigned int size() const { return n; }
+};
+
+/**
+ * A template scaled for all depths it can be matched at. Each bin holds the template scaled by an integer
+ * percentage, the points of all bins are stored one after the other.
+ */
+struct TemplateBank {
+    TemplatePoints points;				/*!< Points of all bins */
+    std::vector<unsigned int> offsets;	/*!< Index of the first point of each bin, and the total number of points */
+    std::vector<cv::Rect> boxes;		/*!< Bounding box of each bin */
+    int min_scale;						/*!< Scale (percentage) of the first bin */
+
+    TemplateBank() : min_scale(0) {}
+
+    unsigned int numBins() const { return boxes.size(); }
+
+    // view on the template of the bin closest to the given scale (clipped to the available bins)
+    TemplateView view(float scale) const {
+        TemplateView v;
+        if (boxes.empty() || points.x.empty())
+            return v;
+
+        float last = boxes.size() - 1;
+        int bin = scale - min_scale > 0 ? cvRound(std::min(scale - min_scale, last)) : 0;
+        v.x = &points.x[0] + offsets[bin];
+        v.y = &points.y[0] + offsets[bin];
+        v.n = offsets[bin + 1] - offsets[bin];
+        v.box = boxes[bin];
+        return v;
+    }
+};
+
+/**
+ * Template match of a previous measurement of an object, used as initial guess when matching the next one
+ */
+struct MatchHint {
+    bool valid;			/*!< A previous match is available */
+    TemplateType type;	/*!< Template that matched */
+    cv::Point2f pos;	/*!< Position of the template in the image */
+    float angle;		/*!< Rotation of the template (radians) */
+
+    MatchHint() : valid(false), type(NoMatch), angle(0) {}
+};
+
 /**
  * Persistency memory structure
  */
@@ -17,6 +17,9 @@
 
 #include <boost/filesystem.hpp>
 
+// Match tracks of entities that were not seen for this long (in seconds) are removed
+const double MATCH_TRACK_TIMEOUT = 10;
+
 // ----------------------------------------------------------------------------------------------------
 
 HumanContourMatcher::HumanContourMatcher() :
@@ -68,6 +71,15 @@ void HumanContourMatcher::configure(tue::Configuration config) {
     if (!config.value("dt_slices_num", num_slices_matching_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'dt_slices_num' not found. Using default: " << num_slices_matching_ << std::endl;
 
+    if (!config.value("dt_pyramid_levels", pyramid_levels_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'dt_pyramid_levels' not found. Using default: " << pyramid_levels_ << std::endl;
+
+    if (!config.value("parallel_template_matching", parallel_matching_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'parallel_template_matching' not found. Using default: " << parallel_matching_ << std::endl;
+
+    if (!config.value("match_warm_start", warm_start_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'match_warm_start' not found. Using default: " << warm_start_ << std::endl;
+
     if (!config.value("type_positive_score", type_positive_score_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'type_positive_score' not found. Using default: " << type_positive_score_ << std::endl;
 
@@ -91,7 +103,9 @@ void HumanContourMatcher::configure(tue::Configuration config) {
                                           dt_line_width_,
                                           max_template_err_,
                                           border_size_,
-                                          num_slices_matching_)){
+                                          num_slices_matching_,
+                                          pyramid_levels_,
+                                          parallel_matching_)){
         std::cout << "[" << module_name_ << "] " << "Initialization incomplete!" << std::endl;
     }
 
@@ -120,6 +134,9 @@ void HumanContourMatcher::loadConfig(const std::string& config_path) {
     max_template_err_ = 15;
     border_size_ = 20;
     num_slices_matching_ = 7;
+    pyramid_levels_ = 2;
+    parallel_matching_ = true;
+    warm_start_ = true;
     type_positive_score_ = 0.9;
     type_negative_score_ = 0.4;
     type_unknown_score_ = 0.05;
@@ -172,15 +189,21 @@ void HumanContourMatcher::process(const ed::perception::WorkerInput& input, ed::
     min_x = depth_image.cols;
     min_y = depth_image.rows;
 
-    cv::Mat depth_mask = cv::Mat::zeros(depth_image.rows, depth_image.cols, CV_8UC1);
-    // Iterate over all points in the mask
+    double depth_sum = 0;
+    int depth_count = 0;
+
+    // Iterate over all points in the mask: bounding box and average of the valid depth values
     for(ed::ImageMask::const_iterator it = msr->imageMask().begin(depth_image.cols); it != msr->imageMask().end(); ++it)
     {
         // mask's (x, y) coordinate in the depth image
         const cv::Point2i p_2d(it());
 
-        // paint a mask
-        depth_mask.at<unsigned char>(p_2d) = 255;
+        float d = depth_image.at<float>(p_2d);
+        if (d > 0 && d == d)
+        {
+            depth_sum += d;
+            ++depth_count;
+        }
 
         // update the boundary coordinates
         if (min_x > p_2d.x) min_x = p_2d.x;
@@ -189,18 +212,28 @@ void HumanContourMatcher::process(const ed::perception::WorkerInput& input, ed::
         if (max_y < p_2d.y) max_y = p_2d.y;
     }
 
-    cv::Rect bouding_box (min_x, min_y, max_x - min_x, max_y - min_y);
+    if (max_x < min_x || max_y < min_y)
+        return;
+
+    cv::Rect bouding_box (min_x, min_y, max_x - min_x + 1, max_y - min_y + 1);
 
-    // create a copy of the depth image region of interest, masked
-    cv::Mat masked_depth_image(depth_image);
-    masked_depth_image.copyTo(masked_depth_image, depth_mask);
-    masked_depth_image = masked_depth_image(bouding_box);
+    // paint a mask, only the size of the bounding box
+    cv::Mat depth_mask = cv::Mat::zeros(bouding_box.height, bouding_box.width, CV_8UC1);
+    for(ed::ImageMask::const_iterator it = msr->imageMask().begin(depth_image.cols); it != msr->imageMask().end(); ++it)
+        depth_mask.at<unsigned char>(cv::Point2i(it()) - bouding_box.tl()) = 255;
 
     // get entity average depth
-    float avg_depth = ed::perception::getAverageDepth(masked_depth_image);
+    float avg_depth = depth_count > 0 ? depth_sum / depth_count : 0;
 
-    // call classifier
-    is_human = human_classifier_.Classify(depth_image, color_image, depth_mask, avg_depth, classification_error, classification_deviation, classification_stance);
+    // call classifier, starting from the entity's previous match
+    MatchHint hint;
+    if (warm_start_)
+        hint = getMatchHint(e->id().str());
+
+    is_human = human_classifier_.Classify(depth_image, color_image, depth_mask, bouding_box.tl(), avg_depth, classification_error, classification_deviation, classification_stance, hint);
+
+    if (warm_start_)
+        updateMatchTrack(e->id().str(), msr->timestamp(), hint);
 
 
     // ----------------------- Assert results -----------------------
@@ -251,4 +284,45 @@ void HumanContourMatcher::process(const ed::perception::WorkerInput& input, ed::
     result.endGroup();  // close perception_result group
 }
 
+// ----------------------------------------------------------------------------------------------------
+
+MatchHint HumanContourMatcher::getMatchHint(const std::string& id) const
+{
+    boost::lock_guard<boost::mutex> lg(match_tracks_mutex_);
+
+    std::map<std::string, MatchTrack>::const_iterator it = match_tracks_.find(id);
+    if (it == match_tracks_.end())
+        return MatchHint();
+
+    return it->second.hint;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void HumanContourMatcher::updateMatchTrack(const std::string& id, double timestamp, const MatchHint& hint) const
+{
+    boost::lock_guard<boost::mutex> lg(match_tracks_mutex_);
+
+    // forget tracks of entities that were not seen for a while
+    for(std::map<std::string, MatchTrack>::iterator it = match_tracks_.begin(); it != match_tracks_.end(); )
+    {
+        if (it->second.timestamp < timestamp - MATCH_TRACK_TIMEOUT)
+            match_tracks_.erase(it++);
+        else
+            ++it;
+    }
+
+    if (!hint.valid)
+    {
+        match_tracks_.erase(id);
+        return;
+    }
+
+    MatchTrack& track = match_tracks_[id];
+    track.hint = hint;
+    track.timestamp = timestamp;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 ED_REGISTER_PERCEPTION_MODULE(HumanContourMatcher)
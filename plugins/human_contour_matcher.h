@@ -11,6 +11,10 @@
 
 #include "human_classifier.h"
 
+#include <boost/thread/mutex.hpp>
+
+#include <map>
+
 class HumanContourMatcher : public ed::perception::Module
 {
 
@@ -33,12 +37,32 @@ private:
     int dt_line_width_;
     int border_size_;
     int num_slices_matching_;
+    int pyramid_levels_;
+    bool parallel_matching_;
     double max_template_err_;
 
     double type_positive_score_;
     double type_negative_score_;
     double type_unknown_score_;
 
+    // Warm start: the match of an entity's last measurement is the initial guess for its next measurement
+    struct MatchTrack
+    {
+        MatchHint hint;
+        double timestamp;
+    };
+
+    bool warm_start_;
+
+    mutable boost::mutex match_tracks_mutex_;
+    mutable std::map<std::string, MatchTrack> match_tracks_;
+
+    // the entity's last match, invalid if there is none
+    MatchHint getMatchHint(const std::string& id) const;
+
+    // store the entity's last match, and forget those of entities that were not seen for a while
+    void updateMatchTrack(const std::string& id, double timestamp, const MatchHint& hint) const;
+
 public:
 
     HumanContourMatcher();
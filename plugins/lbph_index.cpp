@@ -0,0 +1,299 @@
+#include "lbph_index.h"
+#include "histogram_distance.h"
+
+#include <cfloat>
+#include <cmath>
+#include <limits>
+
+namespace
+{
+
+struct CompareDistance
+{
+    CompareDistance(const std::vector<double>& distances_) : distances(distances_) {}
+
+    bool operator()(int i, int j) const { return distances[i] < distances[j]; }
+
+    const std::vector<double>& distances;
+};
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LBPHIndex::LBPHIndex() : radius_(1), neighbors_(8), grid_x_(8), grid_y_(8), threshold_(DBL_MAX),
+    num_candidates_(10), max_checks_(0)
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+LBPHIndex::~LBPHIndex()
+{
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LBPHIndex::clear()
+{
+    histograms_.release();
+    labels_.clear();
+    nodes_.clear();
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LBPHIndex::build(const cv::Ptr<cv::FaceRecognizer>& model)
+{
+    clear();
+
+    radius_ = model->getInt("radius");
+    neighbors_ = model->getInt("neighbors");
+    grid_x_ = model->getInt("grid_x");
+    grid_y_ = model->getInt("grid_y");
+    threshold_ = model->getDouble("threshold");
+
+    std::vector<cv::Mat> histograms = model->getMatVector("histograms");
+    cv::Mat labels = model->getMat("labels");
+
+    if (histograms.empty() || labels.total() != histograms.size())
+        return;
+
+    // Store the histograms contiguously
+    histograms_.create(histograms.size(), histograms[0].total(), CV_32FC1);
+    for(unsigned int i = 0; i < histograms.size(); ++i)
+    {
+        if (histograms[i].total() != (size_t)histograms_.cols)
+        {
+            clear();
+            return;
+        }
+
+        histograms[i].reshape(1, 1).copyTo(histograms_.row(i));
+        labels_.push_back(labels.at<int>(i));
+    }
+
+    // Build the tree. The order of the histograms is the order in which faces were learned (grouped per
+    // person), so shuffle to get representative vantage points.
+    std::vector<int> indices(labels_.size());
+    for(unsigned int i = 0; i < indices.size(); ++i)
+        indices[i] = i;
+
+    cv::RNG rng(0x5eed);
+    for(int i = (int)indices.size() - 1; i > 0; --i)
+        std::swap(indices[i], indices[rng.uniform(0, i + 1)]);
+
+    std::vector<double> distances(labels_.size());
+    std::vector<double> scores(labels_.size());
+    nodes_.reserve(labels_.size());
+    buildNode(indices, 0, indices.size(), distances, scores);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int LBPHIndex::buildNode(std::vector<int>& indices, int begin, int end, std::vector<double>& distances, std::vector<double>& scores)
+{
+    if (begin >= end)
+        return -1;
+
+    int node_idx = nodes_.size();
+    nodes_.push_back(Node());
+
+    int vp = indices[begin];
+    double radius = 0;
+    int inside = -1;
+    int outside = -1;
+
+    if (end - begin > 1)
+    {
+        ed::perception::symmetricChiSquareDistances(histograms_.ptr<float>(vp), histograms_.ptr<float>(0), histograms_.step1(),
+                                                    &indices[begin + 1], end - begin - 1, histograms_.cols, &scores[0]);
+
+        for(int i = begin + 1; i < end; ++i)
+            distances[indices[i]] = std::sqrt(scores[i - begin - 1]);
+
+        // Split the remaining points at the median distance to the vantage point
+        int median = (begin + 1 + end) / 2;
+        std::nth_element(indices.begin() + begin + 1, indices.begin() + median, indices.begin() + end, CompareDistance(distances));
+        radius = distances[indices[median]];
+
+        inside = buildNode(indices, begin + 1, median, distances, scores);
+        outside = buildNode(indices, median, end, distances, scores);
+    }
+
+    Node& n = nodes_[node_idx];
+    n.index = vp;
+    n.radius = radius;
+    n.inside = inside;
+    n.outside = outside;
+
+    return node_idx;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LBPHIndex::search(int node, const float* query, CandidateHeap& candidates, unsigned int& checks) const
+{
+    if (node < 0 || (max_checks_ > 0 && checks >= max_checks_))
+        return;
+
+    const Node& n = nodes_[node];
+
+    double d = std::sqrt(ed::perception::symmetricChiSquareDistance(histograms_.ptr<float>(n.index), query, histograms_.cols));
+    ++checks;
+
+    if (candidates.size() < num_candidates_ || d < candidates.front().first)
+    {
+        if (candidates.size() == num_candidates_)
+        {
+            std::pop_heap(candidates.begin(), candidates.end());
+            candidates.pop_back();
+        }
+
+        candidates.push_back(std::make_pair(d, n.index));
+        std::push_heap(candidates.begin(), candidates.end());
+    }
+
+    // Visit the side the query is on first, the other side only if it can contain points closer than the
+    // current furthest candidate (tau)
+    if (d < n.radius)
+    {
+        double tau = candidates.size() < num_candidates_ ? DBL_MAX : candidates.front().first;
+        if (d - tau <= n.radius)
+            search(n.inside, query, candidates, checks);
+
+        tau = candidates.size() < num_candidates_ ? DBL_MAX : candidates.front().first;
+        if (d + tau >= n.radius)
+            search(n.outside, query, candidates, checks);
+    }
+    else
+    {
+        double tau = candidates.size() < num_candidates_ ? DBL_MAX : candidates.front().first;
+        if (d + tau >= n.radius)
+            search(n.outside, query, candidates, checks);
+
+        tau = candidates.size() < num_candidates_ ? DBL_MAX : candidates.front().first;
+        if (d - tau <= n.radius)
+            search(n.inside, query, candidates, checks);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool LBPHIndex::predict(const cv::Mat& face, int& label, double& distance) const
+{
+    if (nodes_.empty() || face.type() != CV_8UC1)
+        return false;
+
+    cv::Mat query;
+    computeHistogram(face, query);
+
+    if (query.cols != histograms_.cols)
+        return false;
+
+    const float* q = query.ptr<float>(0);
+
+    CandidateHeap candidates;
+    candidates.reserve(num_candidates_ + 1);
+
+    unsigned int checks = 0;
+    search(0, q, candidates, checks);
+
+    // Re-rank the candidates with the LBPH distance
+    std::vector<int> candidate_indices(candidates.size());
+    for(unsigned int i = 0; i < candidates.size(); ++i)
+        candidate_indices[i] = candidates[i].second;
+
+    std::vector<double> scores(candidates.size());
+    ed::perception::chiSquareDistances(q, histograms_.ptr<float>(0), histograms_.step1(), &candidate_indices[0],
+                                       candidate_indices.size(), histograms_.cols, &scores[0]);
+
+    label = -1;
+    distance = DBL_MAX;
+
+    for(unsigned int i = 0; i < scores.size(); ++i)
+    {
+        if (scores[i] < distance && scores[i] < threshold_)
+        {
+            distance = scores[i];
+            label = labels_[candidate_indices[i]];
+        }
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void LBPHIndex::computeHistogram(const cv::Mat& face, cv::Mat& histogram) const
+{
+    int num_patterns = 1 << neighbors_;
+
+    histogram = cv::Mat::zeros(1, grid_x_ * grid_y_ * num_patterns, CV_32FC1);
+
+    // Extended (circular) local binary patterns
+    cv::Mat lbp = cv::Mat::zeros(face.rows - 2 * radius_, face.cols - 2 * radius_, CV_32SC1);
+    if (lbp.rows <= 0 || lbp.cols <= 0)
+        return;
+
+    for(int n = 0; n < neighbors_; ++n)
+    {
+        float x = static_cast<float>(radius_ * cos(2.0 * CV_PI * n / static_cast<float>(neighbors_)));
+        float y = static_cast<float>(-radius_ * sin(2.0 * CV_PI * n / static_cast<float>(neighbors_)));
+
+        int fx = static_cast<int>(floor(x));
+        int fy = static_cast<int>(floor(y));
+        int cx = static_cast<int>(ceil(x));
+        int cy = static_cast<int>(ceil(y));
+
+        float ty = y - fy;
+        float tx = x - fx;
+
+        float w1 = (1 - tx) * (1 - ty);
+        float w2 =      tx  * (1 - ty);
+        float w3 = (1 - tx) *      ty;
+        float w4 =      tx  *      ty;
+
+        for(int i = radius_; i < face.rows - radius_; ++i)
+        {
+            const unsigned char* row_c = face.ptr<unsigned char>(i);
+            const unsigned char* row_f = face.ptr<unsigned char>(i + fy);
+            const unsigned char* row_cl = face.ptr<unsigned char>(i + cy);
+            int* lbp_row = lbp.ptr<int>(i - radius_);
+
+            for(int j = radius_; j < face.cols - radius_; ++j)
+            {
+                float t = static_cast<float>(w1 * row_f[j + fx] + w2 * row_f[j + cx] + w3 * row_cl[j + fx] + w4 * row_cl[j + cx]);
+                lbp_row[j - radius_] += ((t > row_c[j]) || (std::abs(t - row_c[j]) < std::numeric_limits<float>::epsilon())) << n;
+            }
+        }
+    }
+
+    // Normalized histogram per grid cell
+    int width = lbp.cols / grid_x_;
+    int height = lbp.rows / grid_y_;
+    double scale = (width * height > 0 ? 1.0 / (width * height) : 0);
+
+    std::vector<int> counts(num_patterns);
+    float* h = histogram.ptr<float>(0);
+
+    for(int i = 0; i < grid_y_; ++i)
+    {
+        for(int j = 0; j < grid_x_; ++j)
+        {
+            std::fill(counts.begin(), counts.end(), 0);
+
+            for(int y = i * height; y < (i + 1) * height; ++y)
+            {
+                const int* lbp_row = lbp.ptr<int>(y);
+                for(int x = j * width; x < (j + 1) * width; ++x)
+                    ++counts[lbp_row[x]];
+            }
+
+            for(int k = 0; k < num_patterns; ++k)
+                h[k] = static_cast<float>(counts[k] * scale);
+
+            h += num_patterns;
+        }
+    }
+}
@@ -0,0 +1,77 @@
+#ifndef ED_PERCEPTION_LBPH_INDEX_H_
+#define ED_PERCEPTION_LBPH_INDEX_H_
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/contrib/contrib.hpp>
+
+#include <algorithm>
+#include <vector>
+
+// Nearest neighbour index over the spatial LBP histograms of a trained LBPH FaceRecognizer, to avoid comparing a
+// probe with every stored histogram. The histograms are organized in a vantage point tree using the square root
+// of the symmetric chi-square distance, which is a metric. The closest candidates are re-ranked with the
+// distance LBPH itself uses, so labels and distances are on the same scale as FaceRecognizer::predict.
+class LBPHIndex
+{
+
+public:
+
+    LBPHIndex();
+
+    ~LBPHIndex();
+
+    // Builds the index from the histograms, labels and parameters of a trained LBPH FaceRecognizer
+    void build(const cv::Ptr<cv::FaceRecognizer>& model);
+
+    void clear();
+
+    unsigned int size() const { return labels_.size(); }
+
+    // Number of nearest neighbours (in the symmetric distance) that are re-ranked
+    void setNumCandidates(unsigned int n) { num_candidates_ = std::max(1u, n); }
+
+    // Maximum number of histograms compared while searching the tree (0 means no limit). Lower values are faster,
+    // but the closest histogram may be missed.
+    void setMaxChecks(unsigned int n) { max_checks_ = n; }
+
+    // Like FaceRecognizer::predict: label is set to the label of the closest histogram, or -1 if none is closer
+    // than the threshold of the model. Returns false if the face can not be handled by the index (only 8-bit
+    // grayscale faces are supported).
+    bool predict(const cv::Mat& face, int& label, double& distance) const;
+
+private:
+
+    struct Node
+    {
+        int index;      // row in histograms_ (vantage point)
+        double radius;  // median distance of the points below this node to the vantage point
+        int inside;     // subtree with distance <= radius (-1 if none)
+        int outside;    // subtree with distance >= radius (-1 if none)
+    };
+
+    typedef std::vector<std::pair<double, int> > CandidateHeap;
+
+    int buildNode(std::vector<int>& indices, int begin, int end, std::vector<double>& distances, std::vector<double>& scores);
+
+    void search(int node, const float* query, CandidateHeap& candidates, unsigned int& checks) const;
+
+    // Same spatial histogram as the LBPH FaceRecognizer computes for a face
+    void computeHistogram(const cv::Mat& face, cv::Mat& histogram) const;
+
+    int radius_;
+    int neighbors_;
+    int grid_x_;
+    int grid_y_;
+    double threshold_;
+
+    cv::Mat histograms_;        // one histogram per row
+    std::vector<int> labels_;   // label per histogram
+
+    std::vector<Node> nodes_;
+
+    unsigned int num_candidates_;
+    unsigned int max_checks_;
+
+};
+
+#endif
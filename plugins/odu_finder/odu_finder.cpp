@@ -1,6 +1,8 @@
 #include <ros/ros.h>
 #include <dirent.h>
+#include <algorithm>
 #include <cmath>
+#include <cstdio>
 #include <sys/stat.h>
 #include <ANN/ANN.h>
 #include <math.h>
@@ -9,22 +11,71 @@
 #include "rospack/rospack_backcompat.h"
 #include "common.h"
 #include "odu_finder.h"
+#include "../parallel_for.h"
+
+#include <boost/thread/mutex.hpp>
+
+#include <fcntl.h>
+#include <unistd.h>
 
 using namespace odu_finder;
+
+namespace
+{
+
+// siftfast keeps the images and keypoints it allocates in global lists (DestroyAllImages frees all images), so
+// it can not be used by multiple threads at the same time. Keypoint extraction is therefore serialized, also
+// for concurrent queries; quantization and the database query run in parallel. Replacing siftfast by another
+// (thread-safe) SIFT implementation would change the descriptors, and with that require new vocabulary trees.
+boost::mutex sift_mutex;
+
+void free_keypoints(Keypoint keypoints)
+{
+    boost::lock_guard<boost::mutex> lg(sift_mutex);
+    FreeKeypoints(keypoints);
+}
+
+// number of bytes from the read position to the end of the stream
+size_t remaining_bytes(std::istream& in)
+{
+    std::streampos pos = in.tellg();
+    if (pos < 0)
+        return 0;
+
+    in.seekg(0, std::ios::end);
+    std::streampos end = in.tellg();
+    in.seekg(pos);
+
+    return end > pos ? (size_t) (end - pos) : 0;
+}
+
+// flushes a file (or directory) to disk
+bool sync_to_disk(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    bool ok = fsync(fd) == 0;
+    close(fd);
+    return ok;
+}
+
+}
 ////////////////////////////
 DocumentInfo::DocumentInfo() :
-    delete_document(false) {
+    delete_document(false), document(NULL) {
 }
 
 //////////////////////////////////////////////////////////////////////
-DocumentInfo::DocumentInfo(vt::Document* document, std::string& name) :
-    delete_document(false), document(document), name(name) {
+DocumentInfo::DocumentInfo(vt::Document* document, std::string& name, bool delete_document) :
+    delete_document(delete_document), document(document), name(name) {
 }
 
 ////////////////////////////
 DocumentInfo::~DocumentInfo() {
     if (delete_document)
-        delete[] document;
+        delete document;
 }
 
 ///////////////////////////////////////////
@@ -34,31 +85,57 @@ void DocumentInfo::write(std::ostream& out) {
     out.write(name.c_str(), name.length());
     size_t doc_length = document->size();
     out.write((char*) &doc_length, sizeof(size_t));
-    out.write((char*) &(document->at(0)), doc_length * sizeof(vt::Word));
+    if (doc_length > 0)
+        out.write((char*) &(*document)[0], doc_length * sizeof(vt::Word));
 }
 
 /////////////////////////////////////////
-void DocumentInfo::read(std::istream& in) {
+bool DocumentInfo::read(std::istream& in) {
+    // the sizes are checked against the rest of the stream, so a torn or corrupt entry can not cause a huge allocation
+    size_t remaining = remaining_bytes(in);
+
     size_t length;
-    in.read((char*) &length, sizeof(size_t));
-    char* name = new char[length + 1];
-    in.read(name, length);
-    name[length] = 0;
-    this->name.assign(name);
+    if (remaining < sizeof(size_t) || !in.read((char*) &length, sizeof(size_t)))
+        return false;
+    remaining -= sizeof(size_t);
+    if (length > remaining)
+        return false;
+    remaining -= length;
+
+    std::string doc_name(length, '\0');
+    if (length > 0 && !in.read(&doc_name[0], length))
+        return false;
+
     size_t doc_length;
-    in.read((char*) &doc_length, sizeof(size_t));
-    document = new vt::Document(doc_length);
-    in.read((char*) &document->at(0), doc_length * sizeof(vt::Word));
+    if (remaining < sizeof(size_t) || !in.read((char*) &doc_length, sizeof(size_t)))
+        return false;
+    remaining -= sizeof(size_t);
+    if (doc_length > remaining / sizeof(vt::Word))
+        return false;
+
+    vt::Document* doc = new vt::Document(doc_length);
+    if (doc_length > 0 && !in.read((char*) &(*doc)[0], doc_length * sizeof(vt::Word))) {
+        delete doc;
+        return false;
+    }
+
+    if (delete_document)
+        delete document;
+
+    this->name = doc_name;
+    this->document = doc;
     this->delete_document = true;
-    delete[] name;
+    return true;
 }
 
 
 /////////////////////////////////////////////////////////////////////////////////////
 ODUFinder::ODUFinder(const std::string& database_path, bool debug_mode) :
         camera_image(NULL), template_image(NULL), image(NULL), tree_builder(Feature::Zero()), visualization_mode_(FRAMES),
-    tuning_object_(""), current_mode_(odu_finder::RECOGNITION)
+    tuning_object_(""), current_mode_(odu_finder::RECOGNITION), published_(0), document_log_size_(0)
 {
+    readers_[0] = readers_[1] = 0;
+
 
     debug_mode_ = debug_mode;
     moduleName_ = "odu_finder";
@@ -111,6 +188,17 @@ void ODUFinder::set_object_threshold(double ot)
     object_threshold = 1.0;
 }
 
+void ODUFinder::set_build_params(int threads, unsigned int seed)
+{
+    build_threads = std::max(0, threads);
+    tree_seed = seed;
+}
+
+void ODUFinder::set_document_log_compaction(unsigned int n)
+{
+    document_log_compaction = std::max(1u, n);
+}
+
 //////////////////////
 ODUFinder::~ODUFinder() {
     if (enable_visualization) {
@@ -119,11 +207,11 @@ ODUFinder::~ODUFinder() {
         cvReleaseImage(&image);
         cvDestroyWindow("visualization");
     }
-    delete db;
 
+    // both snapshots hold the same document infos
     std::map<int, DocumentInfo*>::iterator iter;
-    for (iter = documents_map.begin(); iter != documents_map.end(); ++iter)
-        delete[] iter->second;
+    for (iter = snapshots_[0].documents_map.begin(); iter != snapshots_[0].documents_map.end(); ++iter)
+        delete iter->second;
 }
 
 
@@ -152,20 +240,14 @@ bool ODUFinder::loadParams(std::string mode) {
     radius_adaptation_A = 800.0;
     radius_adaptation_K = 0.02;
     count_templates = 0;
+    build_threads = 0;
+    tree_seed = 0x5eed;
+    document_log_compaction = 100;
 
     // if init build and save the database
     if (mode.compare("build_database") == 0){
-        // NOT USED
-        build_database(images_directory_);
-        save_database(database_location_);
-
-        std::cout << "[" << moduleName_ << "] " << "Done building the database!" << std::endl;
-        std::cout << "[" << moduleName_ << "] " << "Loading new database!" << std::endl;
-
-        if (load_database(database_location_) < 0)
-            return false;
-        else
-            return true;
+        rebuild_database();
+        return true;
     // if load, load previously built database and perform recognition
     }else if (mode.compare("load") == 0){
 
@@ -191,13 +273,27 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
 
     std::map<std::string,float> results;
 
+    QueryContext context;
+    size_t& camera_keypoints_count = context.camera_keypoints_count;
+    std::vector<unsigned int>& cluster_sizes = context.cluster_sizes;
+
     // Extract keypoints in the whole image
 
     Keypoint keypoints = extract_keypoints(camera_image_in);
 
-    Keypoint point = keypoints;
+    // The database can be changed while this image is processed, so keep using the same snapshot
+    SnapshotGuard snapshot_guard(*this);
+    const DatabaseSnapshot& snapshot = snapshot_guard.snapshot();
+    if (!snapshot.db) {
+        free_keypoints(keypoints);
+        return results;
+    }
 
-    camera_keypoints_count = 0;
+    const vt::VocabularyTree<Feature>& tree = *snapshot.tree;
+    const vt::Database& database = *snapshot.db;
+    const std::map<int, DocumentInfo*>& documents = snapshot.documents_map;
+
+    Keypoint point = keypoints;
 
     // Push keypoints to the vocabulary tree document
     vt::Document full_doc;
@@ -253,15 +349,13 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
         delete[] points;
     }
 
-    matches_map.clear();
-
     // Search the whole image
 
     // vector of Matches
     vt::Matches matches;
 
     //find #votes_count matches
-    db->find(full_doc, votes_count + 1, matches);
+    database.find(full_doc, votes_count + 1, matches);
 
     // Calculates and accumulates scores for each cluster
     for (size_t c = 0; c < cluster_count; ++c) {
@@ -275,19 +369,19 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
         if (cluster_doc.size() < (size_t) min_cluster_size)
             continue;
 
-        db->find(cluster_doc, votes_count + 1, cluster_matches);
+        database.find(cluster_doc, votes_count + 1, cluster_matches);
 
-        update_matches_map(cluster_matches, cluster_doc.size());
+        update_matches_map(cluster_matches, cluster_doc.size(), context);
 
         if (debug_mode_) std::cout << "[" << moduleName_ << "] " << "Cluster with size " << c << std::endl;
     }
 
-    if (debug_mode_) std::cout << "[" << moduleName_ << "] " << "Matches map size " << matches_map.size() << std::endl;
+    if (debug_mode_) std::cout << "[" << moduleName_ << "] " << "Matches map size " << context.matches_map.size() << std::endl;
 
     // create copy of votes in another structure
-    std::vector<std::pair<uint32_t, float> > votes(matches_map.size());
-    std::map<uint32_t, float>::iterator iter = matches_map.begin();
-    for (int i = 0; iter != matches_map.end(); ++iter, ++i) {
+    std::vector<std::pair<uint32_t, float> > votes(context.matches_map.size());
+    std::map<uint32_t, float>::iterator iter = context.matches_map.begin();
+    for (int i = 0; iter != context.matches_map.end(); ++iter, ++i) {
         votes[i].first = iter->first;
         votes[i].second = iter->second;
     }
@@ -299,7 +393,7 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
     if (debug_mode_){
         std::cout << "[" << moduleName_ << "] " << "Results (threshold = " << object_threshold << ")"  << std::endl;
         for (int i = 0; i < votes.size() ; i++) {
-            std::cout << "[" << moduleName_ << "] " << "\tVotes: " << documents_map[votes[i].first]->name << ", " << votes[i].second << std::endl;
+            std::cout << "[" << moduleName_ << "] " << "\tVotes: " << documents.find(votes[i].first)->second->name << ", " << votes[i].second << std::endl;
         }
     }
 
@@ -329,13 +423,13 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
         if(debug_mode_) std::cout << "[" << moduleName_ << "] " << "Object not recognized" << std::endl;
     }
     else {
-        for (uint i = 0; (i < votes.size() && i < (uint) documents_map.size()); ++i)
+        for (uint i = 0; (i < votes.size() && i < (uint) documents.size()); ++i)
         {
             if (votes[i].second > object_threshold)
             {
                 // For ease of writing
                 float score = votes[i].second;
-                std::string full_name = documents_map[votes[i].first]->name;
+                std::string full_name = documents.find(votes[i].first)->second->name;
 
                 size_t separator_pos = full_name.find_first_of("-");
                 std::string short_name;
@@ -365,12 +459,10 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
         for (int i=0; i<templates_to_show; ++i)
             documents_to_visualize[i] = NULL;
 
-        frame_number++;
-
         // Print the name of the best match
         if (!votes.empty())
         {
-            DocumentInfo* d = documents_map[votes[0].first];
+            DocumentInfo* d = documents.find(votes[0].first)->second;
             size_t position = d->name.find_first_of("-");
 
             // Keep only the class label
@@ -386,17 +478,22 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
         }
 
         //visualize
-        if (enable_visualization) {
-            if (visualization_mode_ == FRAMES)
-            {
-                visualize(camera_image_in, documents_to_visualize, &camera_keypoints);
-            }
-            else
-            {
-                if (documents_to_visualize[0] != NULL)
-                    save_result_for_sequence(documents_to_visualize[0]->name);
-            }
+        {
+            boost::lock_guard<boost::mutex> lg(visualization_mutex_);
+            frame_number++;
 
+            if (enable_visualization) {
+                if (visualization_mode_ == FRAMES)
+                {
+                    visualize(camera_image_in, documents_to_visualize, &camera_keypoints, context);
+                }
+                else
+                {
+                    if (documents_to_visualize[0] != NULL)
+                        save_result_for_sequence(documents_to_visualize[0]->name);
+                }
+
+            }
         }
         delete[] documents_to_visualize;
     }
@@ -409,7 +506,7 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
     }
     */
 
-    FreeKeypoints(keypoints);
+    free_keypoints(keypoints);
 
     // normalize results, 0 to 1
     double max = 0;
@@ -424,49 +521,182 @@ std::map<std::string, float> ODUFinder::process_image(IplImage* camera_image_in)
     return results;
 }
 
+///////////////////////////////////////////////////////////////
+
+void ODUFinder::create_document(IplImage* camera_image_in, vt::Document& doc) {
+    Keypoint keypoints = extract_keypoints(camera_image_in);
+
+    doc.clear();
+
+    SnapshotGuard snapshot_guard(*this);
+    const DatabaseSnapshot& snapshot = snapshot_guard.snapshot();
+    if (snapshot.tree) {
+        for (Keypoint point = keypoints; point != NULL; point = point->next) {
+            Feature feature(point->descrip);
+            doc.push_back(snapshot.tree->quantize(feature));
+        }
+    }
+
+    free_keypoints(keypoints);
+}
+
+///////////////////////////////////////////////////////////////
+
+ODUFinder::SnapshotGuard::SnapshotGuard(const ODUFinder& finder) : finder_(finder) {
+    boost::lock_guard<boost::mutex> lg(finder_.snapshot_mutex_);
+    index_ = finder_.published_;
+    ++finder_.readers_[index_];
+}
+
+ODUFinder::SnapshotGuard::~SnapshotGuard() {
+    boost::lock_guard<boost::mutex> lg(finder_.snapshot_mutex_);
+    if (--finder_.readers_[index_] == 0)
+        finder_.readers_done_.notify_all();
+}
+
+///////////////////////////////////////////////////////////////
+
+DatabaseSnapshot& ODUFinder::publish_snapshot() {
+    boost::unique_lock<boost::mutex> lock(snapshot_mutex_);
+    int previous = published_;
+    published_ = 1 - previous;
+
+    // new queries use the published snapshot, only wait for the ones that still use the previous one
+    while (readers_[previous] > 0)
+        readers_done_.wait(lock);
+
+    return snapshots_[previous];
+}
+
+///////////////////////////////////////////////////////////////
+
+void ODUFinder::replace_database(const DatabaseSnapshot& snapshot) {
+    boost::lock_guard<boost::mutex> update_lock(update_mutex_);
+
+    std::map<int, DocumentInfo*> old_documents;
+    old_documents.swap(snapshots_[1 - published_].documents_map);
+
+    snapshots_[1 - published_] = snapshot;
+    DatabaseSnapshot& previous = publish_snapshot();
+    previous.tree = snapshot.tree;
+    previous.db.reset(new vt::Database(*snapshot.db));
+    previous.documents_map = snapshot.documents_map;
+
+    counter_ = snapshot.documents_map.size()+1; // to avoid overwriting previous images during learning add a unique number behind the image
+
+    // no query uses the old database anymore
+    std::map<int, DocumentInfo*>::iterator iter;
+    for (iter = old_documents.begin(); iter != old_documents.end(); ++iter)
+        delete iter->second;
+}
+
+///////////////////////////////////////////////////////////////
+
+int ODUFinder::insert_document(DatabaseSnapshot& snapshot, DocumentInfo* document_info) {
+    // insert keeps the document frequency of every word up to date, and the weights only depend on those and
+    // the number of documents, so updating them is linear in the vocabulary size and not in the database size
+    int id = snapshot.db->insert(*document_info->document);
+    snapshot.documents_map[id] = document_info;
+    snapshot.db->computeTfIdfWeights(1);
+    return id;
+}
+
+struct ODUFinder::ProcessFileTask
+{
+    ProcessFileTask(ODUFinder& finder_, const std::vector<std::string>& filenames_, std::vector<FeatureVector>& images_,
+                    bool onlySaveImages_)
+        : finder(finder_), filenames(filenames_), images(images_), onlySaveImages(onlySaveImages_) {}
+
+    void operator()(unsigned int i) const
+    {
+        finder.process_file(filenames[i], images[i], onlySaveImages);
+    }
+
+    ODUFinder& finder;
+    const std::vector<std::string>& filenames;
+    std::vector<FeatureVector>& images;
+    bool onlySaveImages;
+};
+
+/////////////////////////////////////////////////////
+
+struct ODUFinder::QuantizeTask
+{
+    QuantizeTask(const vt::VocabularyTree<Feature>& tree_, const std::vector<FeatureVector>& images_, std::vector<vt::Document>& docs_)
+        : tree(tree_), images(images_), docs(docs_) {}
+
+    void operator()(unsigned int i) const
+    {
+        docs[i].resize(images[i].size());
+        for (unsigned int j = 0; j < images[i].size(); ++j)
+            docs[i][j] = tree.quantize(images[i][j]);
+    }
+
+    const vt::VocabularyTree<Feature>& tree;
+    const std::vector<FeatureVector>& images;
+    std::vector<vt::Document>& docs;
+};
+
+/////////////////////////////////////////////////////
+
+void ODUFinder::rebuild_database() {
+    build_database(images_directory_);
+    save_database(database_location_);
+
+    std::cout << "[" << moduleName_ << "] " << "Done building the database!" << std::endl;
+}
+
 /////////////////////////////////////////////////////
 
 void ODUFinder::build_database(std::string directory) {
+    std::vector<std::string> filenames;
+    image_names.clear();
+    trace_directory(directory.c_str(), "", filenames);
+
     std::vector<FeatureVector> images;
-    trace_directory(directory.c_str(), "", images);
+    process_files(filenames, images);
 
     std::cout << "[" << moduleName_ << "] " << "Preparing features for the tree..." << std::endl;
 
+    size_t num_features = 0;
+    for (unsigned int i = 0; i < images.size(); ++i)
+        num_features += images[i].size();
+
     FeatureVector all_features;
+    all_features.reserve(num_features);
     for (unsigned int i = 0; i < images.size(); ++i)
-        for (unsigned int j = 0; j < images[i].size(); ++j)
-            all_features.push_back(images[i][j]);
+        all_features.insert(all_features.end(), images[i].begin(), images[i].end());
 
     std::cout << "[" << moduleName_ << "] " << "Building a tree with " << all_features.size() << " nodes..." << std::endl;
 
+    tree_builder.setSeed(tree_seed);
+    tree_builder.setMaxThreads(build_threads);
     tree_builder.build(all_features, tree_k, tree_levels);
-    tree = tree_builder.tree();
 
     std::cout << "[" << moduleName_ << "] " << "Creating the documents..." << std::endl;
 
-    docs.resize(images.size());
-
-    for (unsigned int i = 0; i < images.size(); ++i) {
-        //printf("\tImage %d\n", i);
-        for (unsigned int j = 0; j < images[i].size(); ++j) {
-            //printf("\t\tFeature %d\n", j);
-            docs[i].push_back(tree.quantize(images[i][j]));
-        }
-    }
+    std::vector<vt::Document> docs(images.size());
+    ed::perception::parallelFor(images.size(), QuantizeTask(tree_builder.tree(), images, docs), build_threads);
 
     std::cout << "[" << moduleName_ << "] " << "Creating database..." <<std::endl;
 
-    db = new vt::Database(tree.words());
+    DatabaseSnapshot snapshot;
+    snapshot.tree.reset(new vt::VocabularyTree<Feature>(tree_builder.tree()));
+    snapshot.db.reset(new vt::Database(snapshot.tree->words()));
 
     std::cout << "[" << moduleName_ << "] " << "Populating the database with the documents..." << std::endl;
 
     for (unsigned int i = 0; i < images.size(); ++i) {
-        documents_map[db->insert(docs[i])] = new DocumentInfo(&(docs[i]),
-                                                              image_names[i]);
+        vt::Document* doc = new vt::Document;
+        doc->swap(docs[i]);
+        snapshot.documents_map[snapshot.db->insert(*doc)] = new DocumentInfo(doc, image_names[i], true);
     }
 
     std::cout << "[" << moduleName_ << "] " << "Training database..." << std::endl;
-    db->computeTfIdfWeights(1);
+    snapshot.db->computeTfIdfWeights(1);
+
+    // the new database replaces the current one (which may have been loaded)
+    replace_database(snapshot);
 
     std::cout << "[" << moduleName_ << "] " << "Database created!" << std::endl;
 }
@@ -474,32 +704,104 @@ void ODUFinder::build_database(std::string directory) {
 /////////////////////////////////////////////////////
 
 void ODUFinder::process_images(std::string directory) {
+    std::vector<std::string> filenames;
+    trace_directory(directory.c_str(), "", filenames);
+
     std::vector<FeatureVector> images;
-    trace_directory(directory.c_str(), "", images, true);
+    process_files(filenames, images, true);
+}
+
+/////////////////////////////////////////////////////
+
+void ODUFinder::process_files(const std::vector<std::string>& filenames, std::vector<FeatureVector>& images, bool onlySaveImages) {
+    images.clear();
+    images.resize(filenames.size());
+    ed::perception::parallelFor(filenames.size(), ProcessFileTask(*this, filenames, images, onlySaveImages), build_threads);
 }
 
 /////////////////////////////////////////////////////////////////
 
 void ODUFinder::save_database_without_tree(std::string& directory) {
-    std::cout << "[" << moduleName_ << "] " << "Saving documents..." << std::endl;
+    boost::lock_guard<boost::mutex> storage_lock(storage_mutex_);
 
-    std::string documents_file(directory);
-    documents_file.append("/images.documents");
-    std::ofstream out(documents_file.c_str(), std::ios::out | std::ios::binary);
-    size_t map_size = documents_map.size();
-    out.write((char*) &map_size, sizeof(size_t));
-    std::map<int, DocumentInfo*>::iterator iter;
-    for (iter = documents_map.begin(); iter != documents_map.end(); ++iter) {
-        out.write((char*) &iter->first, sizeof(int));
-        iter->second->write(out);
+    // The files are written next to the old ones, synced and renamed over them, so after a crash the old or the
+    // new files are complete. The weights are replaced first: if only they are new, the log still holds the
+    // documents that are missing in images.documents, and loading recomputes the weights.
+    std::string documents_file(directory + "/images.documents");
+    std::string weights_file(directory + "/images.weights");
+    std::string documents_tmp(documents_file + ".tmp");
+    std::string weights_tmp(weights_file + ".tmp");
+
+    bool ok;
+    {
+        SnapshotGuard snapshot_guard(*this);
+        const DatabaseSnapshot& snapshot = snapshot_guard.snapshot();
+        const std::map<int, DocumentInfo*>& documents_map = snapshot.documents_map;
+
+        std::cout << "[" << moduleName_ << "] " << "Saving documents..." << std::endl;
+
+        std::ofstream out(documents_tmp.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+        size_t map_size = documents_map.size();
+        out.write((char*) &map_size, sizeof(size_t));
+        std::map<int, DocumentInfo*>::const_iterator iter;
+        for (iter = documents_map.begin(); iter != documents_map.end(); ++iter) {
+            out.write((char*) &iter->first, sizeof(int));
+            iter->second->write(out);
+        }
+        out.close();
+        ok = !out.fail();
+
+        std::cout << "[" << moduleName_ << "] " << "Saving weights..." << std::endl;
+
+        snapshot.db->saveWeights(weights_tmp.c_str());
     }
 
-    std::cout << "[" << moduleName_ << "] " << "Saving weights..." << std::endl;
+    ok = ok && sync_to_disk(documents_tmp) && sync_to_disk(weights_tmp)
+            && std::rename(weights_tmp.c_str(), weights_file.c_str()) == 0
+            && std::rename(documents_tmp.c_str(), documents_file.c_str()) == 0;
 
-    std::string weights_file(directory);
-    weights_file.append("/images.weights");
-    db->saveWeights(weights_file.c_str());
+    if (!ok) {
+        std::cout << "[" << moduleName_ << "] " << "Could not save the database in " << directory << std::endl;
+        std::remove(documents_tmp.c_str());
+        std::remove(weights_tmp.c_str());
+        return;
+    }
+
+    sync_to_disk(directory);
+
+    // all documents are in images.documents now, so the log can be emptied
+    std::string log_file(directory);
+    log_file.append("/images.documents.log");
+    std::ofstream log(log_file.c_str(), std::ios::out | std::ios::binary | std::ios::trunc);
+    if (directory == database_location_)
+        document_log_size_ = 0;
+}
+
+/////////////////////////////////////////////////////
+
+unsigned int ODUFinder::append_to_document_log(const std::string& directory, int id, DocumentInfo& document_info) {
+    boost::lock_guard<boost::mutex> storage_lock(storage_mutex_);
+
+    std::string log_file(directory);
+    log_file.append("/images.documents.log");
+    std::ofstream out(log_file.c_str(), std::ios::out | std::ios::binary | std::ios::app);
+    out.seekp(0, std::ios::end);
+    std::streampos entry_start = out.tellp();
+
+    out.write((char*) &id, sizeof(int));
+    document_info.write(out);
     out.close();
+
+    if (out.fail() || entry_start < 0 || !sync_to_disk(log_file)) {
+        std::cout << "[" << moduleName_ << "] " << "Could not append the learned document to " << log_file.c_str() << std::endl;
+
+        // a partly written entry would end the log when it is loaded, also for the documents appended after it
+        if (entry_start >= 0 && truncate(log_file.c_str(), entry_start) != 0)
+            std::cout << "[" << moduleName_ << "] " << "Could not truncate " << log_file.c_str() << std::endl;
+        return 0;
+    }
+
+    return ++document_log_size_;
 }
 
 /////////////////////////////////////////////////////
@@ -508,19 +810,29 @@ void ODUFinder::save_database(std::string& directory) {
     std::cout << "[" << moduleName_ << "] " << "Saving the tree..." << std::endl;
     std::string tree_file(directory);
     tree_file.append("/images.tree");
-    tree.save(tree_file.c_str());
+    {
+        SnapshotGuard snapshot_guard(*this);
+        snapshot_guard.snapshot().tree->save(tree_file.c_str());
+    }
     save_database_without_tree(directory);
 }
 
 /////////////////////////////////////////////////////
 
 int ODUFinder::load_database(const std::string& directory) {
+    // the log is read and cut off here
+    boost::lock_guard<boost::mutex> storage_lock(storage_mutex_);
+
 //    std::cout << "[" << moduleName_ << "] " << "Loading the tree..." << std::endl;
 
+    DatabaseSnapshot snapshot;
+    boost::shared_ptr<vt::VocabularyTree<Feature> > tree(new vt::VocabularyTree<Feature>);
+    snapshot.tree = tree;
+
     std::string tree_file(directory);
     tree_file.append("/images.tree");
     try {
-        tree.load(tree_file.c_str());
+        tree->load(tree_file.c_str());
     }
     catch (std::runtime_error e)
     {
@@ -530,7 +842,9 @@ int ODUFinder::load_database(const std::string& directory) {
 
 //    std::cout << "[" << moduleName_ << "] " << "Initializing the database..." << std::endl;
 
-    db = new vt::Database(tree.words());//, tree.splits());
+    snapshot.db.reset(new vt::Database(tree->words()));//, tree->splits());
+    vt::Database* db = snapshot.db.get();
+    std::map<int, DocumentInfo*>& documents_map = snapshot.documents_map;
     std::string documents_file(directory);
     documents_file.append("/images.documents");
 
@@ -543,26 +857,76 @@ int ODUFinder::load_database(const std::string& directory) {
         return -1;
     }
 
-    size_t map_size;
-    in.read((char*) &map_size, sizeof(size_t));
+    size_t map_size = 0;
+    if (!in.read((char*) &map_size, sizeof(size_t))) {
+        std::cout << "[" << moduleName_ << "] " << "Unable to load the documents from " << documents_file.c_str() << std::endl;
+        return -1;
+    }
+
+    bool complete = true;
     for (size_t i = 0; i < map_size; ++i) {
         int id;
         DocumentInfo* document_info = new DocumentInfo();
-        in.read((char*) &id, sizeof(int));
-        document_info->read(in);
+        if (!in.read((char*) &id, sizeof(int)) || !document_info->read(in)) {
+            std::cout << "[" << moduleName_ << "] " << "Documents file " << documents_file.c_str() << " is corrupt, only "
+                      << i << " of " << map_size << " documents loaded" << std::endl;
+            delete document_info;
+            complete = false;
+            map_size = i;
+            break;
+        }
         vt::Document* doc = document_info->document;
         int d = db->insert(*doc);
         documents_map[d] = document_info;
     }
 
-    counter_ = map_size+1; // to avoid overwriting previous images during learning add a unique number behind the image
+    in.close();
+
+    // documents learned after the last compaction. Entries that are already in images.documents (if saving
+    // was interrupted before the log was emptied) are skipped. An incomplete or corrupt entry (if learning was
+    // interrupted while appending) ends the log: it is cut off there, so new entries are appended after the last
+    // good one.
+    std::string log_file(directory);
+    log_file.append("/images.documents.log");
+    std::ifstream log(log_file.c_str(), std::ios::in | std::ios::binary);
+
+    document_log_size_ = 0;
+    while (log.is_open()) {
+        std::streampos entry_start = log.tellg();
+        int id;
+        if (!log.read((char*) &id, sizeof(int)) && log.gcount() == 0)
+            break;
+
+        DocumentInfo* document_info = new DocumentInfo();
+        if (!log || !document_info->read(log)) {
+            delete document_info;
+            log.close();
+            std::cout << "[" << moduleName_ << "] " << "Dropping the incomplete last entry of " << log_file.c_str() << std::endl;
+            if (truncate(log_file.c_str(), entry_start) != 0)
+                std::cout << "[" << moduleName_ << "] " << "Could not truncate " << log_file.c_str() << std::endl;
+            break;
+        }
+
+        if (id < (int) map_size) {
+            delete document_info;
+            continue;
+        }
+
+        documents_map[db->insert(*document_info->document)] = document_info;
+        ++document_log_size_;
+    }
 
 //    std::cout << "[" << moduleName_ << "] " << "Loading weights..." << std::endl;
 
+    // the saved weights do not include the logged (or missing) documents, but they only depend on the document frequencies
     std::string weights_file(directory);
     weights_file.append("/images.weights");
-    db->loadWeights(weights_file.c_str());
-    in.close();
+    if (document_log_size_ == 0 && complete)
+        db->loadWeights(weights_file.c_str());
+    else
+        db->computeTfIdfWeights(1);
+
+    replace_database(snapshot);
 
     return 1;
 }
@@ -570,16 +934,29 @@ int ODUFinder::load_database(const std::string& directory) {
 ///////////////////////////////////////////////////////////////////////////
 
 void ODUFinder::add_image_to_database(vt::Document& doc, std::string& name) {
-    docs.push_back(doc);
-    documents_map[db->insert(doc)] = new DocumentInfo(&doc, name);
-    db->computeTfIdfWeights(1);
+    DocumentInfo* document_info = new DocumentInfo(new vt::Document(doc), name, true);
+    int id;
+
+    {
+        boost::lock_guard<boost::mutex> update_lock(update_mutex_);
+
+        // change the snapshot that is not used, publish it and then change the previous one as well
+        id = insert_document(snapshots_[1 - published_], document_info);
+        insert_document(publish_snapshot(), document_info);
+    }
+
     //TODO: Why do we not update the images.tree???
-    save_database_without_tree(database_location_);
+
+    // only append the document, and rewrite the whole database once the log gets long. If the document could not
+    // be appended, it is only saved with the next compaction
+    unsigned int log_size = append_to_document_log(database_location_, id, *document_info);
+    if (log_size > 0 && log_size >= document_log_compaction)
+        save_database_without_tree(database_location_);
 }
 
 ///////////////////////////////////////////////////////////////////////////////////////
 
-void ODUFinder::trace_directory(const char* dir, const char* prefix, std::vector<FeatureVector>& images, bool onlySaveImages) {
+void ODUFinder::trace_directory(const char* dir, const char* prefix, std::vector<std::string>& filenames) {
     std::cout << "[" << moduleName_ << "] " << "Tracing directory: " << dir << std::endl;
     DIR *pdir = opendir(dir);
     struct dirent *pent = NULL;
@@ -605,9 +982,9 @@ void ODUFinder::trace_directory(const char* dir, const char* prefix, std::vector
             if (S_ISDIR(st_buf.st_mode)) {
                 filename.append("/");
                 short_filename.append("/");
-                trace_directory(filename.c_str(), short_filename.c_str(), images, onlySaveImages);
+                trace_directory(filename.c_str(), short_filename.c_str(), filenames);
             } else {
-                process_file(filename, images, onlySaveImages);
+                filenames.push_back(filename);
                 image_names.push_back(short_filename);
             }
         }
@@ -618,7 +995,8 @@ void ODUFinder::trace_directory(const char* dir, const char* prefix, std::vector
 //////////////////////////////////////////////////////////////////////
 void ODUFinder::visualize(IplImage *camera_image_in,
                           DocumentInfo** template_document_info,
-                          std::vector<KeypointExt*> *camera_keypoints) {
+                          std::vector<KeypointExt*> *camera_keypoints,
+                          const QueryContext& context) {
     int templates_count = 0;
 
 
@@ -718,7 +1096,7 @@ void ODUFinder::visualize(IplImage *camera_image_in,
         if (camera_keypoints != NULL)
         {
             for (unsigned int i = 0; i < camera_keypoints->size(); ++i) {
-                if (cluster_sizes[(*camera_keypoints)[i]->cluster]>= (size_t) min_cluster_size)
+                if (context.cluster_sizes[(*camera_keypoints)[i]->cluster]>= (size_t) min_cluster_size)
                     cvCircle(image, cvPoint((int) ((*camera_keypoints)[i]->keypoint->col),
                                             (int) ((*camera_keypoints)[i]->keypoint->row)), 3,
                              color_table[(*camera_keypoints)[i]->cluster % COLORS]);
@@ -757,7 +1135,9 @@ void ODUFinder::visualize(IplImage *camera_image_in,
 
 /////////////////////////////////////////////////////////////////////
 
-void ODUFinder::update_matches_map(vt::Matches& matches, size_t size) {
+void ODUFinder::update_matches_map(const vt::Matches& matches, size_t size, QueryContext& context) const {
+    std::map<uint32_t, float>& matches_map = context.matches_map;
+
     for (int i = 0; (i < votes_count && i < (int) matches.size()); ++i) {
         if (matches_map.count(matches[i].id) == 0)
             matches_map[matches[i].id] = 0;
@@ -785,15 +1165,18 @@ void ODUFinder::update_matches_map(vt::Matches& matches, size_t size) {
 
 /////////////////////////////////////////////////////////////////////////////////////
 
-void ODUFinder::process_file(std::string& filename, std::vector<FeatureVector>& images, bool onlySaveImages) {
+void ODUFinder::process_file(const std::string& filename, FeatureVector& features, bool onlySaveImages) {
     std::cout << "[" << moduleName_ << "] " << "Processing file " << filename.c_str() << "..." << std::endl;
 
     IplImage *image = cvLoadImage((char*) filename.c_str(), CV_LOAD_IMAGE_GRAYSCALE);
-    Keypoint keypoints = extract_keypoints(image);
+    if (image == NULL) {
+        std::cout << "[" << moduleName_ << "] " << "Could not load " << filename.c_str() << std::endl;
+        return;
+    }
 
-    std::cout << "[" << moduleName_ << "] " << "Keypoints extracted" << std::endl;
+    Keypoint keypoints = extract_keypoints(image);
 
-    FeatureVector features;
+    features.clear();
     Keypoint p = keypoints;
     int count = 0;
 
@@ -804,9 +1187,7 @@ void ODUFinder::process_file(std::string& filename, std::vector<FeatureVector>&
         ++count;
     }
 
-    if (!onlySaveImages)
-        images.push_back(features);
-    else {
+    if (onlySaveImages) {
         IplImage *colour_image = cvLoadImage((char*) filename.c_str());
         p = keypoints;
         while (p != NULL) {
@@ -816,15 +1197,17 @@ void ODUFinder::process_file(std::string& filename, std::vector<FeatureVector>&
         }
         cvSaveImage((char*) filename.c_str(), colour_image);
         cvReleaseImage(&colour_image);
+        features.clear();
     }
     cvReleaseImage(&image);
-    FreeKeypoints(keypoints);
+    free_keypoints(keypoints);
     std::cout << "[" << moduleName_ << "] " << "Done! " << count << " features found!" << std::endl;
 }
 
 ///////////////////////////////////////////////////////////////////////
 
 Keypoint ODUFinder::extract_keypoints(IplImage *image, bool frames_only) {
+    boost::lock_guard<boost::mutex> lg(sift_mutex);
 
     Image sift_image = CreateImage(image->height, image->width);
 
@@ -906,6 +1289,7 @@ void ODUFinder::clear_sequence_buffer() {
 }
 
 int ODUFinder::get_n_models_loaded(){
-    return documents_map.size();
+    SnapshotGuard snapshot_guard(*this);
+    return snapshot_guard.snapshot().documents_map.size();
 }
 
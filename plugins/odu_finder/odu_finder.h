@@ -24,6 +24,11 @@
 #include <siftfast/siftfast.h>
 #include "common.h"
 
+#include <boost/shared_ptr.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include "parallel_tree_builder.h"
+
 class TuningSummary
 {
 
@@ -88,10 +93,33 @@ public:
     vt::Document* document;
     std::string name;
     DocumentInfo();
-    DocumentInfo(vt::Document* document, std::string& name);
+    DocumentInfo(vt::Document* document, std::string& name, bool delete_document = false);
     ~DocumentInfo();
     void write (std::ostream& out);
-    void read(std::istream& in);
+    // false if the stream ends early or holds sizes that do not fit in the rest of it (the document is then not set)
+    bool read(std::istream& in);
+};
+
+/** \brief state of a single recognition query, so that multiple images can be processed at the same time
+ */
+struct QueryContext
+{
+    QueryContext() : camera_keypoints_count(0) {}
+
+    size_t camera_keypoints_count;
+    std::vector<unsigned int> cluster_sizes;
+    //map of DocumentIDs and their scores in the database
+    std::map<uint32_t, float> matches_map;
+};
+
+/** \brief the database as seen by recognition. A snapshot is not changed while queries use it: changes are made on
+ * the snapshot that is not published, which then replaces the published one (see ODUFinder::publish_snapshot)
+ */
+struct DatabaseSnapshot
+{
+    boost::shared_ptr<const vt::VocabularyTree<Feature> > tree;
+    boost::shared_ptr<vt::Database> db;
+    std::map<int, DocumentInfo*> documents_map;
 };
 
 class ODUFinder
@@ -111,26 +139,18 @@ public:
     // IMAGES
     IplImage *camera_image, *template_image, *image ,*image_roi;
 
-    // DATABASE
-    std::vector<vt::Document> docs;
-    vt::TreeBuilder<Feature> tree_builder;
-    vt::VocabularyTree<Feature> tree;
-    vt::Database* db;
+    // DATABASE (see snapshots_)
+    ParallelTreeBuilder<Feature> tree_builder;
     std::vector<std::string> image_names;
-    std::map<int, DocumentInfo*> documents_map;
 
     // VISUALIZATION
     CvScalar color_table[COLORS];
-    std::vector<unsigned int> cluster_sizes;
     std::string output_image_topic_;
     VisualizationMode visualization_mode_;
     std::vector<std::string> sequence_buffer;
     bool pein_vis_;
 
     // RECOGNITION
-    size_t camera_keypoints_count;
-    //map of DocumentIDs and their scores in the database
-    std::map<uint32_t, float> matches_map;
     std::list<int> sliding_window;
     std::map<int, int> last_templates;
     double object_threshold;
@@ -142,6 +162,9 @@ public:
     int enable_clustering, enable_incremental_learning, enable_visualization, sliding_window_size, templates_to_show;
     double radius_adaptation_r_min, radius_adaptation_r_max, radius_adaptation_K, radius_adaptation_A;
     int count_templates;
+    int build_threads;      // threads used to build the database (0: one per core)
+    unsigned int tree_seed; // seed of the k-means initialization, the tree only depends on the seed and the images
+    unsigned int document_log_compaction; // learned documents in images.documents.log before the database is rewritten
 
     //! Tuning mode
     ros::ServiceServer srv_server_;
@@ -169,25 +192,51 @@ public:
    */
     void set_object_threshold(double ot);
 
-    /** \brief Create a visualization window and start the visualization threas
-   * \param enable_visualization
+    /**
+   * @brief Set the parameters used when the database is built
+   * @param threads number of threads (0: one per core)
+   * @param seed seed of the k-means initialization of the vocabulary tree
+   */
+    void set_build_params(int threads, unsigned int seed);
+
+    /**
+   * @brief Set the number of learned documents in images.documents.log after which the database is rewritten
+   * @param n number of documents (at least 1)
+   */
+    void set_document_log_compaction(unsigned int n);
+
+    /** \brief recognizes the objects in an image, using the published database snapshot. Can be called from
+   * multiple threads at the same time, also while the database is changed. Only the keypoint extraction is
+   * serialized between the threads (siftfast is not thread-safe)
+   * \param camera_image input camera image
    */
     std::map<std::string, float> process_image(IplImage* camera_image);
 
+    /** \brief extracts the keypoints of an image and quantizes them into a document
+   * \param camera_image input image
+   * \param doc resulting document
+   */
+    void create_document(IplImage* camera_image, vt::Document& doc);
+
     int start();
 
-    /** \brief builds the vocabulary tree and trains the database
+    /** \brief builds the vocabulary tree and trains the database. Replaces the current database
    * \param directory directory with training images
    */
     void build_database(std::string directory);
 
+    /** \brief builds the database from the model images with the build parameters (see set_build_params) and saves it
+   */
+    void rebuild_database();
+
     /** \brief only called with "sift_only" command argument
       for extracting of keypoints
    * \param directory directory with training images
    */
     void process_images(std::string directory);
 
-    /** \brief saves images.weights, images.documents (faster than save_database function)
+    /** \brief saves images.weights, images.documents (faster than save_database function) and empties images.documents.log.
+   * The files are written to temporary files, synced and renamed, so a crash leaves either the old or the new files.
    * \param directory target directory for database
    */
     void save_database_without_tree(std::string& directory);
@@ -197,12 +246,15 @@ public:
    */
     void save_database(std::string& directory);
 
-    /** \brief loads the database, that is images.tree, images.weights, images.documents
+    /** \brief loads the database, that is images.tree, images.weights, images.documents and the documents learned
+   * afterwards from images.documents.log
    * \param directory storage location for database
    */
     int load_database(const std::string& directory);
 
-    /** \brief adds new templates to the database
+    /** \brief adds new templates to the database, in time linear in the document size. Running queries keep using
+   * the previous snapshot. The document is appended to images.documents.log, the database is only rewritten once
+   * the log is long
    * \param doc full database document
    * \param name new template name (object + time stamp in this case)
    */
@@ -224,17 +276,25 @@ protected:
     /** \brief recursively traces the directory with images
    * \param dir parent directory
    * \param prefix
-   * \param images vector of extracted keypoints
+   * \param filenames paths of the images found (their names relative to the top directory are added to image_names)
+   */
+    void trace_directory(const char* dir, const char* prefix, std::vector<std::string>& filenames);
+
+    /** \brief extracts the keypoints of all images, in parallel
+   * \param filenames input training images
+   * \param images extracted keypoints, one vector per image
    * \param onlySaveImages whether we only extract keypoints and save images with them
    */
-    void trace_directory(const char* dir, const char* prefix, std::vector<FeatureVector>& images, bool onlySaveImages = false);
+    void process_files(const std::vector<std::string>& filenames, std::vector<FeatureVector>& images, bool onlySaveImages = false);
 
     /** \brief visualization function
    * \param camera_image_in input camera image
    * \param template_document_info which documents to visualize
    * \param camera_keypoints a pointer to the vector containing the keypoints extracted in the input image or NULL if no keypoints are provided
+   * \param context query the keypoints belong to
    */
-    void visualize(IplImage *camera_image_in, DocumentInfo** template_document_info, std::vector<KeypointExt*> *camera_keypoints);
+    void visualize(IplImage *camera_image_in, DocumentInfo** template_document_info, std::vector<KeypointExt*> *camera_keypoints,
+                   const QueryContext& context);
 
     /** \brief Adds the current result to the sequence buffer in order to be visualized later by visualize_sequence
    * \param camera_image_in input camera image
@@ -256,15 +316,27 @@ protected:
   * (matches_map) which is a map of Document IDs  and their scores in the database.
   * \param matches - vector of Match-es (see vocabulary tree API)
   * \param size - currently unused
+  * \param context - query of which the matches map is updated
   */
-    void update_matches_map(vt::Matches& matches, size_t size);
+    void update_matches_map(const vt::Matches& matches, size_t size, QueryContext& context) const;
+
+    /** \brief appends a learned document to images.documents.log and syncs it to disk
+   * \param directory storage location for database
+   * \param id document id in the database
+   * \param document_info document to append
+   * \return number of documents in the log, 0 if the document could not be appended (the log is then unchanged)
+   */
+    unsigned int append_to_document_log(const std::string& directory, int id, DocumentInfo& document_info);
 
     /** \brief extract keypoints from training images and optionally saves them
    * \param filename input training image
-   * \param images extracted keypoints
+   * \param features extracted keypoints
    * \param onlySaveImages whether to save images or not
    */
-    void process_file(std::string& filename, std::vector<FeatureVector>& images, bool onlySaveImages = false);
+    void process_file(const std::string& filename, FeatureVector& features, bool onlySaveImages = false);
+
+    struct ProcessFileTask;
+    struct QuantizeTask;
 
     /** \brief extracts SIFT keypoints
    * \param filename input image
@@ -275,6 +347,56 @@ protected:
     bool srvCB(pein_srvs::TuningMode::Request req, pein_srvs::TuningMode::Response resp);
 
     bool loadParams(std::string mode);
+
+    /** \brief keeps the published snapshot from being changed while a query uses it
+   */
+    class SnapshotGuard
+    {
+    public:
+        SnapshotGuard(const ODUFinder& finder);
+        ~SnapshotGuard();
+        const DatabaseSnapshot& snapshot() const { return finder_.snapshots_[index_]; }
+    private:
+        const ODUFinder& finder_;
+        int index_;
+    };
+
+    /** \brief publishes the snapshot that is not published and waits until the queries that use the previous
+   * one are done. update_mutex_ must be locked
+   * \return the previous snapshot, which can then be changed in the same way
+   */
+    DatabaseSnapshot& publish_snapshot();
+
+    /** \brief replaces the database by a new one. The document infos of the old one are deleted
+   * \param snapshot new database
+   */
+    void replace_database(const DatabaseSnapshot& snapshot);
+
+    /** \brief inserts a document into a snapshot and updates its weights (in time linear in the document and
+   * vocabulary size)
+   * \return document id
+   */
+    int insert_document(DatabaseSnapshot& snapshot, DocumentInfo* document_info);
+
+    //! Two copies of the database: queries use the published one and changes are made on the other one, so
+    //! learning neither copies the database nor waits for queries that start after it (left-right scheme)
+    DatabaseSnapshot snapshots_[2];
+    int published_;
+    mutable unsigned int readers_[2];
+    mutable boost::mutex snapshot_mutex_;
+    mutable boost::condition_variable readers_done_;
+
+    //! Serializes changes to the database
+    boost::mutex update_mutex_;
+
+    //! Serializes writing the database files and the document log
+    boost::mutex storage_mutex_;
+
+    //! Number of documents in images.documents.log
+    unsigned int document_log_size_;
+
+    //! Visualization and the sequence buffer are shared by all queries
+    boost::mutex visualization_mutex_;
 };
 }
 #endif  //#ifndef ODU_FINDER_H_
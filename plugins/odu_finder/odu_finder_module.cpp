@@ -16,10 +16,13 @@
 
 #include "../shared_methods.h"
 
+#include <algorithm>
+#include <sstream>
+
 
 // ----------------------------------------------------------------------------------------------------
 
-ODUFinderModule::ODUFinderModule() : ed::perception::Module("odu_finder"), initialized_(false), odu_finder_(NULL)
+ODUFinderModule::ODUFinderModule() : ed::perception::BatchModule("odu_finder"), initialized_(false), odu_finder_(NULL)
 {
     this->registerPropertyServed("type");
 }
@@ -51,16 +54,73 @@ void ODUFinderModule::classify(const ed::Entity& e, const std::string& property,
     // Process image
 
     IplImage img(cropped_mono_image);
-    std::map<std::string, float> results;
+    std::map<std::string, float> results = odu_finder_->process_image(&img);
+
+    writeResults(results, cropped_mono_image, output);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+struct ODUFinderModule::ProcessImageTask
+{
+    ProcessImageTask(const ODUFinderModule& module_, const std::vector<ed::EntityConstPtr>& entities_,
+                     std::vector<cv::Mat>& images_, std::vector<unsigned char>& valid_,
+                     std::vector<std::map<std::string, float> >& results_)
+        : module(module_), entities(entities_), images(images_), valid(valid_), results(results_) {}
 
+    void operator()(unsigned int i) const
     {
-        boost::lock_guard<boost::mutex> lg(mutex_update_);
-        results = odu_finder_->process_image(&img);
+        valid[i] = module.extractImage(*entities[i], images[i]);
+        if (!valid[i])
+            return;
+
+        IplImage img(images[i]);
+        results[i] = module.odu_finder_->process_image(&img);
     }
 
+    const ODUFinderModule& module;
+    const std::vector<ed::EntityConstPtr>& entities;
+    std::vector<cv::Mat>& images;
+    std::vector<unsigned char>& valid;
+    std::vector<std::map<std::string, float> >& results;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+void ODUFinderModule::classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                                    const std::vector<ed::perception::CategoricalDistribution>& priors,
+                                    std::vector<ed::perception::ClassificationOutput>& outputs) const
+{
+    ed::ErrorContext errc("Processing entities in ODUFinderModule");
+
+    outputs.resize(entities.size());
+
+    if (!odu_finder_)
+        return;
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Prepare and process images (in parallel)
+
+    std::vector<cv::Mat> images(entities.size());
+    std::vector<unsigned char> valid(entities.size(), 0);
+    std::vector<std::map<std::string, float> > results(entities.size());
+    ed::perception::parallelFor(entities.size(), ProcessImageTask(*this, entities, images, valid, results));
+
     // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
     // Set results
 
+    for(unsigned int i = 0; i < entities.size(); ++i)
+    {
+        if (valid[i])
+            writeResults(results[i], images[i], outputs[i]);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ODUFinderModule::writeResults(const std::map<std::string, float>& results, const cv::Mat& img,
+                                   ed::perception::ClassificationOutput& output) const
+{
     tue::Configuration& result = output.data;
 
     // create group if it doesnt exist
@@ -95,7 +155,7 @@ void ODUFinderModule::classify(const ed::Entity& e, const std::string& property,
     result.endGroup();  // close perception_result group
 
     if (debug_mode_){
-        cv::imwrite(debug_folder_ + ed::Entity::generateID().str() + "_odu_finder_module.png", cropped_mono_image);
+        cv::imwrite(debug_folder_ + ed::Entity::generateID().str() + "_odu_finder_module.png", img);
     }
 }
 
@@ -113,20 +173,41 @@ void ODUFinderModule::addTrainingInstance(const ed::Entity& e, const std::string
     if (!extractImage(e, cropped_mono_image))
         return;
 
+    IplImage img(cropped_mono_image);
     vt::Document doc;
+    odu_finder_->create_document(&img, doc);
+
+    if (doc.empty())
+        return;
 
-    odu_finder_->add_image_to_database();
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Add to database (running classifications keep using the previous snapshot)
+
+    boost::lock_guard<boost::mutex> lg(mutex_update_);
+
+    // the object name is the part before the '-', the rest makes the name unique
+    std::stringstream name;
+    name << value << "-" << odu_finder_->counter_++;
+    std::string template_name = name.str();
 
-    // TODO
+    odu_finder_->add_image_to_database(doc, template_name);
 }
 
 // ----------------------------------------------------------------------------------------------------
 
 void ODUFinderModule::loadRecognitionData(const std::string& path)
 {
-    // creat odu finder instance
+    createODUFinder(path);
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void ODUFinderModule::createODUFinder(const std::string& path)
+{
     delete odu_finder_;
     odu_finder_ = new odu_finder::ODUFinder(path, debug_mode_);
+    odu_finder_->set_build_params(build_threads_, tree_seed_);
+    odu_finder_->set_document_log_compaction(std::max(1, document_log_compaction_));
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -158,7 +239,9 @@ bool ODUFinderModule::extractImage(const ed::Entity& e, cv::Mat& img) const
 
     // convert to grayscale and increase contrast
     cv::cvtColor(cropped_image, img, CV_BGR2GRAY);
-    cv::equalizeHist(croped_mono_image, img);
+    cv::equalizeHist(img, img);
+
+    return true;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -177,6 +260,18 @@ void ODUFinderModule::configure(tue::Configuration config) {
     if (!config.value("debug_folder", debug_folder_, tue::OPTIONAL))
         std::cout << "[" << module_name_ << "] " << "Parameter 'debug_folder' not found. Using default: " << debug_folder_ << std::endl;
 
+    if (!config.value("build_threads", build_threads_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'build_threads' not found. Using default: " << build_threads_ << std::endl;
+
+    if (!config.value("tree_seed", tree_seed_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'tree_seed' not found. Using default: " << tree_seed_ << std::endl;
+
+    if (!config.value("build_database", build_database_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'build_database' not found. Using default: " << build_database_ << std::endl;
+
+    if (!config.value("document_log_compaction", document_log_compaction_, tue::OPTIONAL))
+        std::cout << "[" << module_name_ << "] " << "Parameter 'document_log_compaction' not found. Using default: " << document_log_compaction_ << std::endl;
+
     database_path_ = module_path_ + database_path_;
 
     if (debug_mode_){
@@ -185,7 +280,11 @@ void ODUFinderModule::configure(tue::Configuration config) {
     }
 
     // creat odu finder instance
-    odu_finder_ = new odu_finder::ODUFinder(database_path_, debug_mode_);
+    createODUFinder(database_path_);
+
+    // rebuild the database from the model images, with build_threads and tree_seed
+    if (build_database_)
+        odu_finder_->rebuild_database();
 
     if (odu_finder_->get_n_models_loaded() == 0)
          std::cout << "[" << module_name_ << "] " << "No models were loaded!" << std::endl;
@@ -208,6 +307,10 @@ void ODUFinderModule::loadConfig(const std::string& config_path)
     // default values in case configure(...) is not called!
     score_factor_ = 0.1;
     debug_mode_ = false;
+    build_threads_ = 0;
+    tree_seed_ = 0x5eed;
+    build_database_ = false;
+    document_log_compaction_ = 100;
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -249,12 +352,7 @@ void ODUFinderModule::process(const ed::perception::WorkerInput& input, ed::perc
     // ----------------------- PROCESS IMAGE -----------------------
 
     IplImage img(croped_mono_image);
-    std::map<std::string, float> results;
-
-    {
-        boost::lock_guard<boost::mutex> lg(mutex_update_);
-        results = odu_finder_->process_image(&img);
-    }
+    std::map<std::string, float> results = odu_finder_->process_image(&img);
 
     // ----------------------- ASSERT RESULTS -----------------------
 
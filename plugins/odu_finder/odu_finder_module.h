@@ -7,7 +7,7 @@
 #ifndef ED_PERCEPTION_HUMAN_CONTOUR_MATCHER_H_
 #define ED_PERCEPTION_HUMAN_CONTOUR_MATCHER_H_
 
-#include <ed/perception/module.h>
+#include "../batch_module.h"
 #include <boost/thread.hpp>
 
 #include <opencv2/core/core.hpp>
@@ -17,7 +17,7 @@ namespace odu_finder
     class ODUFinder;
 }
 
-class ODUFinderModule : public ed::perception::Module
+class ODUFinderModule : public ed::perception::BatchModule
 {
 
 public:
@@ -38,6 +38,11 @@ public:
     void classify(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
                   ed::perception::ClassificationOutput& output) const;
 
+    // Prepares and processes the images of all entities in parallel
+    void classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                       const std::vector<ed::perception::CategoricalDistribution>& priors,
+                       std::vector<ed::perception::ClassificationOutput>& outputs) const;
+
     void addTrainingInstance(const ed::Entity& e, const std::string& property, const std::string& value);
 
     void loadRecognitionData(const std::string& path);
@@ -51,16 +56,30 @@ private:
 
     double score_factor_;
 
+    // database build: only done if build_database_ is set, from the model images next to the database
+    bool build_database_;
+    int build_threads_;
+    int tree_seed_;
+    int document_log_compaction_;
+
     std::string database_path_;
     std::string module_path_;
     std::string module_name_;
 
     odu_finder::ODUFinder* odu_finder_;
 
+    // creates the odu finder for the database in 'path', with the configured parameters
+    void createODUFinder(const std::string& path);
+
     bool extractImage(const ed::Entity& e, cv::Mat& img) const;
 
+    struct ProcessImageTask;
+
+    void writeResults(const std::map<std::string, float>& results, const cv::Mat& img, ed::perception::ClassificationOutput& output) const;
+
 protected:
 
+    // Serializes changes to the database. Classification does not take it, it uses a database snapshot.
     mutable boost::mutex mutex_update_;
 };
 
@@ -0,0 +1,262 @@
+#ifndef ODU_FINDER_PARALLEL_TREE_BUILDER_H_
+#define ODU_FINDER_PARALLEL_TREE_BUILDER_H_
+
+#include <vocabulary_tree/tree_builder.h>
+
+#include <opencv2/core/core.hpp>
+
+#include "../parallel_for.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+namespace odu_finder
+{
+
+/**
+ * \brief Builds a vocabulary tree by hierarchical k-means, like vt::TreeBuilder, but using multiple threads.
+ * The tree has the same layout as the one of vt::TreeBuilder, so it can be saved, loaded and used in the same way.
+ * Nodes of the same level are clustered in parallel, and for nodes with many features the assignment step of
+ * k-means is parallel. Every node is initialized with its own random generator, seeded with the seed of the
+ * builder and the index of the node, so the tree only depends on the seed and not on the number of threads.
+ */
+template<class Feature, class FeatureAllocator = typename vt::DefaultAllocator<Feature>::type>
+class ParallelTreeBuilder
+{
+public:
+    typedef typename vt::TreeBuilder<Feature, vt::distance::L2<Feature>, FeatureAllocator>::Tree Tree;
+    typedef std::vector<Feature, FeatureAllocator> FeatureVector;
+
+    ParallelTreeBuilder(const Feature& zero = Feature(), unsigned int seed = 0x5eed, unsigned int max_threads = 0) :
+        zero_(zero), seed_(seed), max_threads_(max_threads), max_iterations_(100)
+    {}
+
+    void setSeed(unsigned int seed) { seed_ = seed; }
+
+    // maximum number of threads used (0 means: one per core)
+    void setMaxThreads(unsigned int max_threads) { max_threads_ = max_threads; }
+
+    void setMaxIterations(unsigned int max_iterations) { max_iterations_ = max_iterations; }
+
+    const Tree& tree() const { return tree_; }
+
+    /** \brief builds a tree with k splits per node and the given number of levels
+   * \param training_features features to cluster
+   * \param k number of splits per node
+   * \param levels number of levels
+   */
+    void build(const FeatureVector& training_features, uint32_t k, uint32_t levels)
+    {
+        tree_.clear();
+        tree_.setSize(levels, k);
+        tree_.centers().reserve(tree_.nodes());
+        tree_.validCenters().reserve(tree_.nodes());
+
+        // subsets of the features to cluster on the current level, in the order of the nodes
+        std::vector<Subset> subsets(1);
+        subsets[0].reserve(training_features.size());
+        for (size_t i = 0; i < training_features.size(); ++i)
+            subsets[0].push_back(&training_features[i]);
+
+        uint64 node_offset = 0;
+        for (uint32_t level = 0; level < levels; ++level)
+        {
+            std::vector<NodeResult> results(subsets.size());
+
+            // large nodes one by one, with a parallel assignment step; the others in parallel
+            std::vector<unsigned int> small_nodes;
+            for (unsigned int i = 0; i < subsets.size(); ++i)
+            {
+                if (subsets[i].size() >= MIN_PARALLEL_ASSIGNMENT)
+                    clusterNode(subsets[i], k, node_offset + i, true, results[i]);
+                else
+                    small_nodes.push_back(i);
+            }
+
+            ed::perception::parallelFor(small_nodes.size(), ClusterTask(*this, subsets, small_nodes, k, node_offset, results),
+                                        max_threads_);
+
+            // append the centers of this level and collect the subsets of the next level, in node order
+            std::vector<Subset> children;
+            children.reserve(subsets.size() * k);
+            for (unsigned int i = 0; i < subsets.size(); ++i)
+            {
+                NodeResult& r = results[i];
+                tree_.centers().insert(tree_.centers().end(), r.centers.begin(), r.centers.end());
+                tree_.validCenters().insert(tree_.validCenters().end(), r.valid.begin(), r.valid.end());
+
+                for (uint32_t c = 0; c < k; ++c)
+                {
+                    children.push_back(Subset());
+                    children.back().swap(r.children[c]);
+                }
+            }
+
+            node_offset += subsets.size();
+            subsets.swap(children);
+        }
+    }
+
+private:
+    typedef std::vector<const Feature*> Subset;
+
+    // nodes with at least this many features use a parallel assignment step
+    static const size_t MIN_PARALLEL_ASSIGNMENT = 20000;
+
+    // features per task of the parallel assignment step
+    static const size_t ASSIGNMENT_CHUNK = 4096;
+
+    struct NodeResult
+    {
+        FeatureVector centers;
+        std::vector<uint8_t> valid;
+        std::vector<Subset> children;
+    };
+
+    struct ClusterTask
+    {
+        ClusterTask(const ParallelTreeBuilder& builder_, const std::vector<Subset>& subsets_, const std::vector<unsigned int>& nodes_,
+                    uint32_t k_, uint64 node_offset_, std::vector<NodeResult>& results_) :
+            builder(builder_), subsets(subsets_), nodes(nodes_), k(k_), node_offset(node_offset_), results(results_) {}
+
+        void operator()(unsigned int i) const
+        {
+            unsigned int node = nodes[i];
+            builder.clusterNode(subsets[node], k, node_offset + node, false, results[node]);
+        }
+
+        const ParallelTreeBuilder& builder;
+        const std::vector<Subset>& subsets;
+        const std::vector<unsigned int>& nodes;
+        uint32_t k;
+        uint64 node_offset;
+        std::vector<NodeResult>& results;
+    };
+
+    struct AssignTask
+    {
+        AssignTask(const Subset& subset_, const FeatureVector& centers_, std::vector<unsigned int>& membership_,
+                   std::vector<unsigned char>& chunk_changed_) :
+            subset(subset_), centers(centers_), membership(membership_), chunk_changed(chunk_changed_) {}
+
+        void operator()(unsigned int chunk) const
+        {
+            size_t end = std::min(subset.size(), (chunk + 1) * ASSIGNMENT_CHUNK);
+            chunk_changed[chunk] = assign(subset, centers, chunk * ASSIGNMENT_CHUNK, end, membership);
+        }
+
+        const Subset& subset;
+        const FeatureVector& centers;
+        std::vector<unsigned int>& membership;
+        std::vector<unsigned char>& chunk_changed;
+    };
+
+    // assigns features [begin, end) of the subset to their closest center, true if any membership changed
+    static bool assign(const Subset& subset, const FeatureVector& centers, size_t begin, size_t end,
+                       std::vector<unsigned int>& membership)
+    {
+        bool changed = false;
+        for (size_t i = begin; i < end; ++i)
+        {
+            unsigned int best = 0;
+            float best_distance = std::numeric_limits<float>::max();
+            for (unsigned int c = 0; c < centers.size(); ++c)
+            {
+                float d = (*subset[i] - centers[c]).squaredNorm();
+                if (d < best_distance)
+                {
+                    best_distance = d;
+                    best = c;
+                }
+            }
+
+            if (membership[i] != best)
+            {
+                membership[i] = best;
+                changed = true;
+            }
+        }
+        return changed;
+    }
+
+    // clusters one node into k children (or, if it has k or fewer features, uses them as the centers)
+    void clusterNode(const Subset& subset, uint32_t k, uint64 node, bool parallel_assignment, NodeResult& result) const
+    {
+        result.children.assign(k, Subset());
+
+        if (subset.size() <= k)
+        {
+            // use the features as centers and mark the others as invalid, all children are empty
+            result.centers.assign(k, zero_);
+            result.valid.assign(k, 0);
+            for (size_t j = 0; j < subset.size(); ++j)
+            {
+                result.centers[j] = *subset[j];
+                result.valid[j] = 1;
+            }
+            return;
+        }
+
+        // initial centers: k different random features
+        cv::RNG rng((uint64)seed_ << 32 | node);
+        std::vector<size_t> perm(subset.size());
+        for (size_t i = 0; i < perm.size(); ++i)
+            perm[i] = i;
+
+        result.centers.resize(k);
+        for (uint32_t c = 0; c < k; ++c)
+        {
+            std::swap(perm[c], perm[c + rng.uniform(0, (int)(subset.size() - c))]);
+            result.centers[c] = *subset[perm[c]];
+        }
+
+        // Lloyd iterations, until the assignment does not change
+        std::vector<unsigned int> membership(subset.size(), k);
+        size_t num_chunks = (subset.size() + ASSIGNMENT_CHUNK - 1) / ASSIGNMENT_CHUNK;
+        std::vector<unsigned char> chunk_changed(num_chunks);
+        std::vector<size_t> counts(k);
+
+        for (unsigned int it = 0; it < max_iterations_; ++it)
+        {
+            bool changed;
+            if (parallel_assignment)
+            {
+                ed::perception::parallelFor(num_chunks, AssignTask(subset, result.centers, membership, chunk_changed), max_threads_);
+                changed = std::find(chunk_changed.begin(), chunk_changed.end(), 1) != chunk_changed.end();
+            }
+            else
+                changed = assign(subset, result.centers, 0, subset.size(), membership);
+
+            if (!changed)
+                break;
+
+            // new centers are the means of their members (empty clusters keep their center)
+            FeatureVector sums(k, zero_);
+            std::fill(counts.begin(), counts.end(), 0);
+            for (size_t i = 0; i < subset.size(); ++i)
+            {
+                sums[membership[i]] += *subset[i];
+                ++counts[membership[i]];
+            }
+
+            for (uint32_t c = 0; c < k; ++c)
+                if (counts[c] > 0)
+                    result.centers[c] = sums[c] / (float)counts[c];
+        }
+
+        result.valid.assign(k, 1);
+        for (size_t i = 0; i < subset.size(); ++i)
+            result.children[membership[i]].push_back(subset[i]);
+    }
+
+    Tree tree_;
+    Feature zero_;
+    unsigned int seed_;
+    unsigned int max_threads_;
+    unsigned int max_iterations_;
+};
+
+}
+
+#endif  //#ifndef ODU_FINDER_PARALLEL_TREE_BUILDER_H_
@@ -0,0 +1,205 @@
+#ifndef ED_PERCEPTION_PARALLEL_FOR_H_
+#define ED_PERCEPTION_PARALLEL_FOR_H_
+
+#include <boost/bind.hpp>
+#include <boost/exception_ptr.hpp>
+#include <boost/noncopyable.hpp>
+#include <boost/thread.hpp>
+
+#include <algorithm>
+#include <list>
+
+namespace ed
+{
+namespace perception
+{
+
+// ----------------------------------------------------------------------------------------------------
+
+namespace detail
+{
+
+template<typename F>
+void callTask(const void* f, unsigned int i)
+{
+    (*static_cast<const F*>(f))(i);
+}
+
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// Fixed set of worker threads that help callers of parallelFor. The threads live as long as the pool, so
+// (thread-local) state of the tasks survives between calls and no threads are created per call. Calls may
+// be made from several threads at the same time, and from within a task. If a task throws, no new indices
+// are started and the exception is rethrown to the caller of parallelFor once the running calls are done.
+class ThreadPool : boost::noncopyable
+{
+
+public:
+
+    // Pool shared by all modules, with one thread less than the number of cores (the caller works too)
+    static ThreadPool& instance()
+    {
+        static ThreadPool pool(std::max(1u, boost::thread::hardware_concurrency()) - 1);
+        return pool;
+    }
+
+    explicit ThreadPool(unsigned int num_threads) : stop_(false)
+    {
+        for(unsigned int t = 0; t < num_threads; ++t)
+            threads_.create_thread(boost::bind(&ThreadPool::workerLoop, this));
+    }
+
+    ~ThreadPool()
+    {
+        {
+            boost::lock_guard<boost::mutex> lg(mutex_);
+            stop_ = true;
+        }
+        work_available_.notify_all();
+        threads_.join_all();
+    }
+
+    unsigned int size() const { return threads_.size(); }
+
+    // Calls f(i) for all i in [0, n) on at most 'max_threads' threads, including the calling thread (0 means:
+    // the caller and all threads of the pool). Returns when all calls are done, or throws the first exception
+    // thrown by f.
+    template<typename F>
+    void parallelFor(unsigned int n, const F& f, unsigned int max_threads = 0)
+    {
+        unsigned int num_threads = (max_threads > 0 ? max_threads : size() + 1);
+        num_threads = std::min(num_threads, std::min(n, size() + 1));
+
+        if (num_threads <= 1)
+        {
+            for(unsigned int i = 0; i < n; ++i)
+                f(i);
+            return;
+        }
+
+        Job job(&detail::callTask<F>, &f, n, num_threads - 1);
+
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        jobs_.push_back(&job);
+        work_available_.notify_all();
+
+        run(job, lock);
+
+        // the job lives on this stack, so wait for the calls that the workers are still doing, also if one failed
+        jobs_.remove(&job);
+        while (job.active > 0 || job.helpers > 0)
+            job_done_.wait(lock);
+
+        if (job.error)
+        {
+            lock.unlock();
+            boost::rethrow_exception(job.error);
+        }
+    }
+
+private:
+
+    struct Job
+    {
+        Job(void (*call_)(const void*, unsigned int), const void* f_, unsigned int n_, unsigned int max_helpers_)
+            : call(call_), f(f_), n(n_), next(0), active(0), helpers(0), max_helpers(max_helpers_) {}
+
+        void (*call)(const void*, unsigned int);
+        const void* f;
+        unsigned int n;
+        unsigned int next;          // next index to call
+        unsigned int active;        // number of calls in progress
+        unsigned int helpers;       // number of workers working on the job
+        unsigned int max_helpers;
+        boost::exception_ptr error; // first exception thrown by a call
+    };
+
+    // Claims and runs indices of the job until none are left. The lock is held on entry and exit. Exceptions
+    // of the calls are stored in the job, and no further indices are claimed after one.
+    void run(Job& job, boost::unique_lock<boost::mutex>& lock)
+    {
+        while (job.next < job.n)
+        {
+            unsigned int i = job.next++;
+            ++job.active;
+
+            lock.unlock();
+
+            boost::exception_ptr error;
+            try
+            {
+                job.call(job.f, i);
+            }
+            catch (...)
+            {
+                error = boost::current_exception();
+            }
+
+            lock.lock();
+
+            if (error)
+            {
+                if (!job.error)
+                    job.error = error;
+                job.next = job.n;
+            }
+
+            if (--job.active == 0)
+                job_done_.notify_all();
+        }
+    }
+
+    void workerLoop()
+    {
+        boost::unique_lock<boost::mutex> lock(mutex_);
+        while (true)
+        {
+            Job* job = 0;
+            for(std::list<Job*>::iterator it = jobs_.begin(); it != jobs_.end() && !job; ++it)
+            {
+                if ((*it)->next < (*it)->n && (*it)->helpers < (*it)->max_helpers)
+                    job = *it;
+            }
+
+            if (!job)
+            {
+                if (stop_)
+                    return;
+
+                work_available_.wait(lock);
+                continue;
+            }
+
+            ++job->helpers;
+            run(*job, lock);
+            if (--job->helpers == 0)
+                job_done_.notify_all();
+        }
+    }
+
+    boost::thread_group threads_;
+
+    boost::mutex mutex_;
+    boost::condition_variable work_available_;
+    boost::condition_variable job_done_;
+    std::list<Job*> jobs_;
+    bool stop_;
+
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+// Calls f(i) for all i in [0, n) on the shared thread pool, using at most 'max_threads' threads including
+// the calling thread (0 means: one per core). For n <= 1 or a single thread, f is simply called in a loop.
+template<typename F>
+void parallelFor(unsigned int n, const F& f, unsigned int max_threads = 0)
+{
+    ThreadPool::instance().parallelFor(n, f, max_threads);
+}
+
+}
+}
+
+#endif
@@ -107,6 +107,29 @@ float getMedianDepth(cv::Mat& depth_img)
 
 // ----------------------------------------------------------------------------------------------------
 
+float getMedianDepth(const ed::Measurement& msr)
+{
+    const cv::Mat& depth_image = msr.image()->getDepthImage();
+
+    std::vector<float> depths;
+    for(ed::ImageMask::const_iterator it = msr.imageMask().begin(depth_image.cols); it != msr.imageMask().end(); ++it)
+    {
+        float d = depth_image.at<float>(it());
+        if (d > 0 && d == d)
+            depths.push_back(d);
+    }
+
+    if (depths.empty())
+        return 0;
+
+    std::vector<float>::iterator it_median = depths.begin() + depths.size() / 2;
+    std::nth_element(depths.begin(), it_median, depths.end());
+
+    return *it_median;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 void optimizeContourHull(const cv::Mat& mask_orig, cv::Mat& mask_optimized) {
 
     std::vector<std::vector<cv::Point> > hull;
@@ -16,6 +16,9 @@ namespace perception
 
     float getMedianDepth(cv::Mat& depth_img);
 
+    // median of the valid depth values within the measurement's image mask, 0 if there are none
+    float getMedianDepth(const ed::Measurement& msr);
+
     // create a new mask based on the convex hull of the original mask
     void optimizeContourHull(const cv::Mat& mask_orig, cv::Mat& mask_optimized);
 
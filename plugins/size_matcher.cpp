@@ -25,6 +25,11 @@
 namespace
 {
 
+const double SIZE_MARGIN = 0.01;
+
+// Cell size (in meters) of the size model grid
+const double GRID_RESOLUTION = 0.05;
+
 bool calculateSize(const ed::Entity& e, double& width, double& height)
 {
     ed::MeasurementConstPtr msr = e.lastMeasurement();
@@ -71,7 +76,7 @@ bool calculateSize(const ed::Entity& e, double& width, double& height)
 
 // ----------------------------------------------------------------------------------------------------
 
-SizeMatcher::SizeMatcher() : Module("size_matcher")
+SizeMatcher::SizeMatcher() : BatchModule("size_matcher"), grid_width_(0), grid_height_(0)
 {
     this->registerPropertyServed("type");
 }
@@ -92,26 +97,26 @@ void SizeMatcher::classify(const ed::Entity& e, const std::string& property, con
     if (!calculateSize(e, width, height))
         return;
 
-    double margin = 0.01;
+    // All models get a zero score, except the ones of which the box contains the measurement
+    std::vector<double> scores(model_names_.size(), 0);
 
-    for(std::map<std::string, SizeModel>::const_iterator it = models_.begin(); it != models_.end(); ++it)
+    if (width >= 0 && height >= 0 && width < grid_width_ * GRID_RESOLUTION && height < grid_height_ * GRID_RESOLUTION)
     {
-        const std::string& model_name = it->first;
-        const SizeModel& model = it->second;
+        int x = std::min(grid_width_ - 1, (int)(width / GRID_RESOLUTION));
+        int y = std::min(grid_height_ - 1, (int)(height / GRID_RESOLUTION));
 
-        if (model.width_min - margin < width && width < model.width_max + margin
-                && model.height_min - margin < height && height < model.height_max + margin)
-        {
-            double score = 1.0 / (model.width_max - model.width_min) + 1.0 / (model.height_max - model.height_min);
-//            double score = 1;
-            output.likelihood.setScore(model_name, score);
-        }
-        else
+        const std::vector<unsigned int>& candidates = grid_[y * grid_width_ + x];
+        for(std::vector<unsigned int>::const_iterator it = candidates.begin(); it != candidates.end(); ++it)
         {
-            output.likelihood.setScore(model_name, 0);
+            const SizeModel& box = model_boxes_[*it];
+            if (box.width_min < width && width < box.width_max && box.height_min < height && height < box.height_max)
+                scores[*it] = model_scores_[*it];
         }
     }
 
+    for(unsigned int i = 0; i < model_names_.size(); ++i)
+        output.likelihood.setScore(model_names_[i], scores[i]);
+
     // Represent data (for debugging)
     tue::Configuration& result = output.data;
     result.setValue("width", width);
@@ -147,6 +152,8 @@ void SizeMatcher::addTrainingInstance(const ed::Entity& e, const std::string& pr
         model.height_min = std::min(model.height_min, height);
         model.height_max = std::max(model.height_max, height);
     }
+
+    updateModelIndex();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -179,6 +186,8 @@ void SizeMatcher::loadRecognitionData(const std::string& path_str)
     }
 
     r.endArray(); // models
+
+    updateModelIndex();
 }
 
 // ----------------------------------------------------------------------------------------------------
@@ -208,5 +217,53 @@ void SizeMatcher::saveRecognitionData(const std::string& path) const
 
 // ----------------------------------------------------------------------------------------------------
 
+void SizeMatcher::updateModelIndex()
+{
+    model_names_.clear();
+    model_boxes_.clear();
+    model_scores_.clear();
+
+    double width_max = 0;
+    double height_max = 0;
+
+    for(std::map<std::string, SizeModel>::const_iterator it = models_.begin(); it != models_.end(); ++it)
+    {
+        const SizeModel& model = it->second;
+
+        SizeModel box;
+        box.width_min = model.width_min - SIZE_MARGIN;
+        box.width_max = model.width_max + SIZE_MARGIN;
+        box.height_min = model.height_min - SIZE_MARGIN;
+        box.height_max = model.height_max + SIZE_MARGIN;
+
+        model_names_.push_back(it->first);
+        model_boxes_.push_back(box);
+        model_scores_.push_back(1.0 / (model.width_max - model.width_min) + 1.0 / (model.height_max - model.height_min));
+
+        width_max = std::max(width_max, box.width_max);
+        height_max = std::max(height_max, box.height_max);
+    }
+
+    grid_width_ = width_max / GRID_RESOLUTION + 1;
+    grid_height_ = height_max / GRID_RESOLUTION + 1;
+    grid_.assign(grid_width_ * grid_height_, std::vector<unsigned int>());
+
+    for(unsigned int i = 0; i < model_boxes_.size(); ++i)
+    {
+        const SizeModel& box = model_boxes_[i];
+
+        int x_min = std::max(0, (int)(box.width_min / GRID_RESOLUTION));
+        int x_max = std::min(grid_width_ - 1, (int)(box.width_max / GRID_RESOLUTION));
+        int y_min = std::max(0, (int)(box.height_min / GRID_RESOLUTION));
+        int y_max = std::min(grid_height_ - 1, (int)(box.height_max / GRID_RESOLUTION));
+
+        for(int y = y_min; y <= y_max; ++y)
+            for(int x = x_min; x <= x_max; ++x)
+                grid_[y * grid_width_ + x].push_back(i);
+    }
+}
+
+// ----------------------------------------------------------------------------------------------------
+
 ED_REGISTER_PERCEPTION_MODULE(SizeMatcher)
 
@@ -7,7 +7,7 @@
 #ifndef ED_PERCEPTION_SIZE_MATCHER_H_
 #define ED_PERCEPTION_SIZE_MATCHER_H_
 
-#include <ed/perception/module.h>
+#include "batch_module.h"
 
 // ----------------------------------------------------------------------------------------------------
 
@@ -21,7 +21,7 @@ struct SizeModel
 
 // ----------------------------------------------------------------------------------------------------
 
-class SizeMatcher : public ed::perception::Module
+class SizeMatcher : public ed::perception::BatchModule
 {
 
 public:
@@ -33,6 +33,14 @@ public:
     void classify(const ed::Entity& e, const std::string& property, const ed::perception::CategoricalDistribution& prior,
                   ed::perception::ClassificationOutput& output) const;
 
+    // classify is thread-safe, so entities are classified in parallel
+    void classifyBatch(const std::vector<ed::EntityConstPtr>& entities, const std::string& property,
+                       const std::vector<ed::perception::CategoricalDistribution>& priors,
+                       std::vector<ed::perception::ClassificationOutput>& outputs) const
+    {
+        classifyBatchParallel(entities, property, priors, outputs);
+    }
+
     void addTrainingInstance(const ed::Entity& e, const std::string& property, const std::string& value);
 
     void loadRecognitionData(const std::string& path);
@@ -43,6 +51,17 @@ private:
 
     std::map<std::string, SizeModel> models_;
 
+    // Uniform grid over (width, height) space. Each cell holds the indices of the models whose box
+    // (including the margin) overlaps the cell, such that classification only tests those candidates.
+    std::vector<std::string> model_names_;
+    std::vector<SizeModel> model_boxes_;            // including margin
+    std::vector<double> model_scores_;
+    std::vector<std::vector<unsigned int> > grid_;  // [y * grid_width_ + x]
+    int grid_width_;
+    int grid_height_;
+
+    void updateModelIndex();
+
 };
 
 #endif
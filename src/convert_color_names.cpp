@@ -0,0 +1,49 @@
+#include "../plugins/color_matcher/color_name_table.h"
+
+#include <cstdlib>
+#include <iostream>
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: convert-color-names SOURCE-TXT-FILE TARGET-BIN-FILE [BITS]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "    BITS: 32 (float, default), 16 or 8 (quantized probabilities)" << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc != 3 && argc != 4)
+    {
+        usage();
+        return 1;
+    }
+
+    int bits = 32;
+    if (argc == 4)
+        bits = std::atoi(argv[3]);
+
+    if (bits != 32 && bits != 16 && bits != 8)
+    {
+        usage();
+        return 1;
+    }
+
+    ColorNameTable table;
+    if (!table.readFromFile(argv[1]))
+    {
+        std::cout << "Could not read color name table from '" << argv[1] << "'" << std::endl;
+        return 1;
+    }
+
+    if (!table.writeToBinaryFile(argv[2], bits))
+    {
+        std::cout << "Could not write color name table to '" << argv[2] << "'" << std::endl;
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,191 @@
+#include "image_crawler.h"
+#include "../plugins/face_detector.h"
+
+#include <ros/time.h>
+
+#include <ed/entity.h>
+
+#include <tue/config/loaders/yaml.h>
+#include <tue/config/reader_writer.h>
+
+#include <cstdlib>
+#include <iostream>
+
+// ----------------------------------------------------------------------------------------------------
+
+void usage()
+{
+    std::cout << "Usage: face-detector-benchmark CASCADE-CONFIG DNN-CONFIG IMAGE-FILE-OR-DIRECTORY [FACE-LABEL]" << std::endl;
+    std::cout << std::endl;
+    std::cout << "    Compares the latency and recall of the cascade and dnn backends of the face detector on annotated" << std::endl;
+    std::cout << "    images. The configs are FaceDetector classification configurations (YAML). Annotated entities" << std::endl;
+    std::cout << "    with label FACE-LABEL (default: human) should contain a face, all others should not." << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+// annotated entities of one image
+struct Sample
+{
+    std::vector<ed::EntityConstPtr> entities;
+    std::vector<bool> has_face;
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+struct Result
+{
+    Result() : num_entities(0), num_faces(0), num_found(0), num_false(0), single_time(0), batch_time(0) {}
+
+    int num_entities;
+    int num_faces;      // entities that contain a face
+    int num_found;      // ... of which the detector found one
+    int num_false;      // entities without a face in which the detector found one
+    double single_time; // total time of classify, one entity per call
+    double batch_time;  // total time of classifyBatch, one image per call
+};
+
+// ----------------------------------------------------------------------------------------------------
+
+bool detectedHuman(const ed::perception::ClassificationOutput& output)
+{
+    double score;
+    return output.likelihood.getScore("human", score) && score > 0;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+bool benchmark(const std::string& config_file, const std::vector<Sample>& samples, Result& result)
+{
+    tue::Configuration config;
+    if (!tue::config::loadFromYAMLFile(config_file, config))
+    {
+        std::cout << "Could not load '" << config_file << "'" << std::endl;
+        return false;
+    }
+
+    FaceDetector detector;
+    detector.configureClassification(config);
+    if (config.hasError())
+    {
+        std::cout << config.error() << std::endl;
+        return false;
+    }
+
+    for(std::vector<Sample>::const_iterator it = samples.begin(); it != samples.end(); ++it)
+    {
+        const Sample& sample = *it;
+        std::vector<ed::perception::CategoricalDistribution> priors(sample.entities.size());
+
+        // one entity per call
+        std::vector<ed::perception::ClassificationOutput> outputs(sample.entities.size());
+        ros::WallTime t_start = ros::WallTime::now();
+        for(unsigned int i = 0; i < sample.entities.size(); ++i)
+            detector.classify(*sample.entities[i], "type", priors[i], outputs[i]);
+        result.single_time += (ros::WallTime::now() - t_start).toSec();
+
+        // all entities of the image in one call
+        std::vector<ed::perception::ClassificationOutput> batch_outputs;
+        t_start = ros::WallTime::now();
+        detector.classifyBatch(sample.entities, "type", priors, batch_outputs);
+        result.batch_time += (ros::WallTime::now() - t_start).toSec();
+
+        for(unsigned int i = 0; i < sample.entities.size(); ++i)
+        {
+            ++result.num_entities;
+
+            bool found = detectedHuman(batch_outputs[i]);
+            if (sample.has_face[i])
+            {
+                ++result.num_faces;
+                if (found)
+                    ++result.num_found;
+            }
+            else if (found)
+            {
+                ++result.num_false;
+            }
+        }
+    }
+
+    return true;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+void printResult(const std::string& backend, const Result& result)
+{
+    std::cout << backend << ":" << std::endl;
+    std::cout << "    entities:             " << result.num_entities << " (" << result.num_faces << " with a face)" << std::endl;
+
+    if (result.num_entities > 0)
+    {
+        std::cout << "    latency (single):     " << 1000 * result.single_time / result.num_entities << " ms / entity" << std::endl;
+        std::cout << "    latency (batch):      " << 1000 * result.batch_time / result.num_entities << " ms / entity" << std::endl;
+    }
+
+    if (result.num_faces > 0)
+        std::cout << "    recall:               " << (double)result.num_found / result.num_faces << std::endl;
+
+    if (result.num_entities > result.num_faces)
+        std::cout << "    false positive rate:  " << (double)result.num_false / (result.num_entities - result.num_faces) << std::endl;
+}
+
+// ----------------------------------------------------------------------------------------------------
+
+int main(int argc, char **argv)
+{
+    if (argc != 4 && argc != 5)
+    {
+        usage();
+        return 1;
+    }
+
+    ros::Time::init();
+
+    std::string face_label = "human";
+    if (argc == 5)
+        face_label = argv[4];
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Load the annotated entities
+
+    ImageCrawler crawler;
+    if (!crawler.setPath(argv[3]))
+        return 1;
+
+    std::vector<Sample> samples;
+
+    AnnotatedImage image;
+    while(crawler.next(image))
+    {
+        std::vector<ed::EntityConstPtr> correspondences;
+        findAnnotationCorrespondences(image, correspondences);
+
+        Sample sample;
+        for(unsigned int i = 0; i < correspondences.size(); ++i)
+        {
+            const Annotation& a = image.annotations[i];
+            if (a.is_supporting || !correspondences[i])
+                continue;
+
+            sample.entities.push_back(correspondences[i]);
+            sample.has_face.push_back(a.label == face_label);
+        }
+
+        if (!sample.entities.empty())
+            samples.push_back(sample);
+    }
+
+    // - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - - -
+    // Run both backends
+
+    Result cascade_result, dnn_result;
+    if (!benchmark(argv[1], samples, cascade_result) || !benchmark(argv[2], samples, dnn_result))
+        return 1;
+
+    printResult("cascade", cascade_result);
+    printResult("dnn", dnn_result);
+
+    return 0;
+}